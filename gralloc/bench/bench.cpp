@@ -0,0 +1,702 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <functional>
+#include <vector>
+
+#include <cutils/properties.h>
+#include <hardware/fb.h>
+#include <hardware/gralloc.h>
+#include <log/log.h>
+
+#include "bench.h"
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*****************************************************************************/
+
+// Host benchmarks of the gralloc HAL. Every case runs in its own process,
+// so it starts from a fresh module (framebuffer, copy threads), and
+// prints one JSON object per line on stdout:
+//
+//   ./gralloc_bench [-d ms] [name-filter]
+
+extern "C" gralloc_module_t HAL_MODULE_INFO_SYM;
+
+struct resolution_t {
+    const char* name;
+    int width;
+    int height;
+};
+
+static const resolution_t sResolutions[] = {
+    { "720p",   1280,  720 },
+    { "1080p",  1920, 1080 },
+    { "1440p",  2560, 1440 },
+    { "4k",     3840, 2160 },
+};
+
+struct format_t {
+    const char* name;
+    int format;
+    int fbBpp;          // 0 if it can't be a framebuffer format
+};
+
+static const format_t sFormats[] = {
+    { "RGBX_8888",      HAL_PIXEL_FORMAT_RGBX_8888,     32 },
+    { "RGB_565",        HAL_PIXEL_FORMAT_RGB_565,       16 },
+    { "YV12",           HAL_PIXEL_FORMAT_YV12,          0 },
+    { "YCbCr_420_888",  HAL_PIXEL_FORMAT_YCBCR_420_888, 0 },
+};
+
+// sources and destinations of the format conversions
+static const format_t sConvertFormats[] = {
+    { "RGBA_8888",      HAL_PIXEL_FORMAT_RGBA_8888,     0 },
+    { "RGBX_8888",      HAL_PIXEL_FORMAT_RGBX_8888,     32 },
+    { "BGRA_8888",      HAL_PIXEL_FORMAT_BGRA_8888,     32 },
+    { "RGB_888",        HAL_PIXEL_FORMAT_RGB_888,       0 },
+    { "RGB_565",        HAL_PIXEL_FORMAT_RGB_565,       16 },
+    { "RGBA_FP16",      HAL_PIXEL_FORMAT_RGBA_FP16,     0 },
+};
+
+static const int sThreadCounts[] = { 1, 2, 4, 8, 16 };
+
+static int64_t sDurationNs = 300 * 1000000LL;
+static const char* sFilter = "";
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+struct result_t {
+    uint64_t ops;
+    uint64_t bytes;
+    int64_t ns;
+    uint64_t faults;    // minor page faults of the whole process
+};
+
+static uint64_t minor_faults()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+static void report(const char* name, const char* format,
+        const resolution_t& res, int threads, const result_t& r)
+{
+    const double seconds = r.ns / 1e9;
+    printf("{\"name\":\"%s\",\"format\":\"%s\",\"resolution\":\"%s\","
+            "\"width\":%d,\"height\":%d,\"threads\":%d,"
+            "\"ops\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+            "\"ns_per_op\":%.1f,\"mib_per_sec\":%.1f,\"faults_per_op\":%.1f}\n",
+            name, format, res.name, res.width, res.height, threads,
+            (unsigned long long)r.ops, seconds, r.ops / seconds,
+            r.ops ? double(r.ns) / r.ops : 0.0,
+            r.bytes / seconds / (1 << 20),
+            r.ops ? double(r.faults) / r.ops : 0.0);
+    fflush(stdout);
+}
+
+static void report_error(const char* name, const char* format,
+        const resolution_t& res, int threads, int err)
+{
+    printf("{\"name\":\"%s\",\"format\":\"%s\",\"resolution\":\"%s\","
+            "\"threads\":%d,\"error\":\"%s\"}\n",
+            name, format, res.name, threads, strerror(-err));
+    fflush(stdout);
+}
+
+// runs 'fn' in a child process, so that each case gets a fresh module
+static void run_case(const char* name, const std::function<void()>& fn)
+{
+    if (!strstr(name, sFilter))
+        return;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        fn();
+        fflush(stdout);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        printf("{\"name\":\"%s\",\"error\":\"crashed (status %d)\"}\n",
+                name, status);
+    }
+}
+
+// runs 'op' on 'threads' threads until the duration elapses
+static result_t run_threads(int threads, const std::function<uint64_t(int)>& op)
+{
+    struct arg_t {
+        const std::function<uint64_t(int)>* op;
+        int index;
+        int64_t deadline;
+        uint64_t ops;
+        uint64_t bytes;
+    };
+    std::vector<arg_t> args(threads);
+    std::vector<pthread_t> tids(threads);
+
+    const uint64_t faults = minor_faults();
+    const int64_t start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        args[i] = arg_t{ &op, i, start + sDurationNs, 0, 0 };
+        pthread_create(&tids[i], 0, [](void* p) -> void* {
+            arg_t* arg = (arg_t*)p;
+            while (now_ns() < arg->deadline) {
+                arg->bytes += (*arg->op)(arg->index);
+                arg->ops++;
+            }
+            return 0;
+        }, &args[i]);
+    }
+    result_t r = { 0, 0, 0, 0 };
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], 0);
+        r.ops += args[i].ops;
+        r.bytes += args[i].bytes;
+    }
+    r.ns = now_ns() - start;
+    r.faults = minor_faults() - faults;
+    return r;
+}
+
+static native_handle_t* clone_handle(buffer_handle_t handle)
+{
+    const size_t len = sizeof(native_handle_t) +
+            sizeof(int) * (handle->numFds + handle->numInts);
+    native_handle_t* clone = (native_handle_t*)malloc(len);
+    memcpy(clone, handle, len);
+    for (int i = 0; i < handle->numFds; i++)
+        clone->data[i] = dup(handle->data[i]);
+    return clone;
+}
+
+static void free_clone(native_handle_t* handle)
+{
+    for (int i = 0; i < handle->numFds; i++)
+        close(handle->data[i]);
+    free(handle);
+}
+
+static alloc_device_t* open_alloc()
+{
+    hw_module_t* module = &HAL_MODULE_INFO_SYM.common;
+    hw_device_t* device = 0;
+    if (module->methods->open(module, GRALLOC_HARDWARE_GPU0, &device))
+        return 0;
+    return (alloc_device_t*)device;
+}
+
+/*****************************************************************************/
+
+static void bench_alloc_free(const format_t& f, const resolution_t& res,
+        int threads)
+{
+    alloc_device_t* dev = open_alloc();
+    const int usage = GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_RENDER;
+    result_t r = run_threads(threads, [&](int) -> uint64_t {
+        buffer_handle_t handle;
+        int stride;
+        if (dev->alloc(dev, res.width, res.height, f.format, usage,
+                &handle, &stride) == 0)
+            dev->free(dev, handle);
+        return 0;
+    });
+    report("alloc_free", f.name, res, threads, r);
+}
+
+static void bench_register(const format_t& f, const resolution_t& res,
+        int threads)
+{
+    alloc_device_t* dev = open_alloc();
+    gralloc_module_t* module = &HAL_MODULE_INFO_SYM;
+    std::vector<native_handle_t*> clones(threads);
+    std::vector<buffer_handle_t> handles(threads);
+    for (int i = 0; i < threads; i++) {
+        int stride;
+        int err = dev->alloc(dev, res.width, res.height, f.format,
+                GRALLOC_USAGE_SW_READ_OFTEN, &handles[i], &stride);
+        if (err) {
+            report_error("register_unregister", f.name, res, threads, err);
+            return;
+        }
+        clones[i] = clone_handle(handles[i]);
+    }
+    result_t r = run_threads(threads, [&](int i) -> uint64_t {
+        if (module->registerBuffer(module, clones[i]) == 0)
+            module->unregisterBuffer(module, clones[i]);
+        return 0;
+    });
+    report("register_unregister", f.name, res, threads, r);
+    for (int i = 0; i < threads; i++) {
+        free_clone(clones[i]);
+        dev->free(dev, handles[i]);
+    }
+}
+
+// with 'traced', the atrace markers are written as they would be during a
+// capture
+static void bench_lock(const format_t& f, const resolution_t& res,
+        int threads, bool traced)
+{
+    const char* name = traced ? "lock_unlock_traced" : "lock_unlock";
+    fakeTraceEnable(traced);
+    alloc_device_t* dev = open_alloc();
+    gralloc_module_t* module = &HAL_MODULE_INFO_SYM;
+    std::vector<buffer_handle_t> handles(threads);
+    for (int i = 0; i < threads; i++) {
+        int stride;
+        int err = dev->alloc(dev, res.width, res.height, f.format,
+                GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN,
+                &handles[i], &stride);
+        if (err) {
+            report_error(name, f.name, res, threads, err);
+            return;
+        }
+    }
+    result_t r = run_threads(threads, [&](int i) -> uint64_t {
+        void* vaddr;
+        if (module->lock(module, handles[i], GRALLOC_USAGE_SW_WRITE_OFTEN,
+                0, 0, res.width, res.height, &vaddr) == 0)
+            module->unlock(module, handles[i]);
+        return 0;
+    });
+    report(name, f.name, res, threads, r);
+    for (int i = 0; i < threads; i++)
+        dev->free(dev, handles[i]);
+}
+
+// locks behind an acquire fence, signaled already as it mostly is by the
+// time the producer dequeues the buffer
+static void bench_lock_async(const format_t& f, const resolution_t& res,
+        int threads)
+{
+    alloc_device_t* dev = open_alloc();
+    gralloc_module_t* module = &HAL_MODULE_INFO_SYM;
+    std::vector<buffer_handle_t> handles(threads);
+    for (int i = 0; i < threads; i++) {
+        int stride;
+        int err = dev->alloc(dev, res.width, res.height, f.format,
+                GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN,
+                &handles[i], &stride);
+        if (err) {
+            report_error("lockAsync_unlockAsync", f.name, res, threads, err);
+            return;
+        }
+    }
+    result_t r = run_threads(threads, [&](int i) -> uint64_t {
+        int fence = fakeFenceCreate();
+        fakeFenceSignal(fence);
+        void* vaddr;
+        if (module->lockAsync(module, handles[i], GRALLOC_USAGE_SW_WRITE_OFTEN,
+                0, 0, res.width, res.height, &vaddr, fence) == 0) {
+            module->unlockAsync(module, handles[i], &fence);
+            if (fence >= 0)
+                close(fence);
+        }
+        return 0;
+    });
+    report("lockAsync_unlockAsync", f.name, res, threads, r);
+    for (int i = 0; i < threads; i++)
+        dev->free(dev, handles[i]);
+}
+
+// a buffer the CPU fills once, as a software decoder or the camera would,
+// with and without the usage-based mapping policy, and with transparent
+// huge pages (effective only where shmem THP is enabled)
+static void bench_alloc_write(const format_t& f, const resolution_t& res,
+        int threads, const char* name)
+{
+    if (!strcmp(name, "alloc_write_nopolicy"))
+        property_set("ro.boot.redroid_gralloc_map_policy", "false");
+    if (!strcmp(name, "alloc_write_thp"))
+        property_set("ro.boot.redroid_gralloc_hugepage", "thp");
+    alloc_device_t* dev = open_alloc();
+    gralloc_module_t* module = &HAL_MODULE_INFO_SYM;
+    const int usage = GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_HW_TEXTURE;
+    result_t r = run_threads(threads, [&](int) -> uint64_t {
+        buffer_handle_t handle;
+        int stride;
+        if (dev->alloc(dev, res.width, res.height, f.format, usage,
+                &handle, &stride))
+            return 0;
+        const size_t size = ((const private_handle_t*)handle)->size;
+        void* vaddr;
+        if (module->lock(module, handle, GRALLOC_USAGE_SW_WRITE_OFTEN,
+                0, 0, res.width, res.height, &vaddr) == 0) {
+            memset(vaddr, 0x5a, size);
+            module->unlock(module, handle);
+        }
+        dev->free(dev, handle);
+        return size;
+    });
+    report(name, f.name, res, threads, r);
+}
+
+// the whole life of a buffer on every thread at once, at sizes varying
+// between 1/8 and all of 'res': allocate, import a copy of the handle, write
+// through it, read back through the allocated one. Fails with EIO when the
+// contents don't survive.
+static void bench_stress(const format_t& f, const resolution_t& res,
+        int threads)
+{
+    alloc_device_t* dev = open_alloc();
+    gralloc_module_t* module = &HAL_MODULE_INFO_SYM;
+    const int usage = GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN;
+    std::vector<uint32_t> rounds(threads);
+    int error = 0;
+    result_t r = run_threads(threads, [&](int i) -> uint64_t {
+        const uint32_t round = rounds[i]++;
+        const int width = res.width >> (round % 4);
+        const int height = res.height >> ((round / 4) % 2);
+        buffer_handle_t handle;
+        int stride;
+        int err = dev->alloc(dev, width, height, f.format, usage,
+                &handle, &stride);
+        if (err) {
+            __atomic_store_n(&error, err, __ATOMIC_RELAXED);
+            return 0;
+        }
+        const size_t size = ((const private_handle_t*)handle)->size;
+        const uint8_t pattern = uint8_t(i * 31 + round);
+        native_handle_t* clone = clone_handle(handle);
+        void* vaddr;
+        err = module->registerBuffer(module, clone);
+        if (!err) {
+            err = module->lock(module, clone, GRALLOC_USAGE_SW_WRITE_OFTEN,
+                    0, 0, width, height, &vaddr);
+            if (!err) {
+                memset(vaddr, pattern, size);
+                module->unlock(module, clone);
+            }
+            module->unregisterBuffer(module, clone);
+        }
+        if (!err) {
+            err = module->lock(module, handle, GRALLOC_USAGE_SW_READ_OFTEN,
+                    0, 0, width, height, &vaddr);
+        }
+        if (!err) {
+            const uint8_t* p = (const uint8_t*)vaddr;
+            // a byte per page, and the last one
+            for (size_t off = 0; off < size && !err; off += PAGE_SIZE) {
+                if (p[off] != pattern)
+                    err = -EIO;
+            }
+            if (p[size - 1] != pattern)
+                err = -EIO;
+            module->unlock(module, handle);
+        }
+        if (err)
+            __atomic_store_n(&error, err, __ATOMIC_RELAXED);
+        free_clone(clone);
+        dev->free(dev, handle);
+        return size;
+    });
+    if (error)
+        report_error("stress", f.name, res, threads, error);
+    else
+        report("stress", f.name, res, threads, r);
+}
+
+// every conversion fb_post can do, checked against the scalar kernels on
+// random pixels (so FP16 NaNs, infinities and subnormals too) then timed
+static void bench_convert(const format_t& src, const format_t& dst,
+        const resolution_t& res)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%s->%s", src.name, dst.name);
+    const size_t srcStride = res.width * formatBytesPerPixel(src.format);
+    const size_t dstStride = res.width * formatBytesPerPixel(dst.format);
+    std::vector<uint8_t> in(srcStride * res.height);
+    std::vector<uint8_t> out(dstStride * res.height);
+    std::vector<uint8_t> ref(dstStride * res.height);
+    srand(1);
+    for (uint8_t& b : in)
+        b = rand();
+
+    convertRows(out.data(), dstStride, dst.format,
+            in.data(), srcStride, src.format, res.width, res.height);
+    for (int y = 0; y < res.height; y++) {
+        convertRowReference(ref.data() + y * dstStride, dst.format,
+                in.data() + y * srcStride, src.format, res.width);
+    }
+    if (out != ref) {
+        report_error("convert", name, res, 1, -EIO);
+        return;
+    }
+
+    result_t r = run_threads(1, [&](int) -> uint64_t {
+        convertRows(out.data(), dstStride, dst.format,
+                in.data(), srcStride, src.format, res.width, res.height);
+        return out.size();
+    });
+    report("convert", name, res, 1, r);
+}
+
+// full-frame copies through the fake fbdev, 'threads' being the number of
+// copy threads of the HAL. In fb_post_thp the posted buffer gets transparent
+// huge pages where shmem THP is enabled, in fb_post_convert it is RGBA_FP16
+// and converted to the framebuffer format.
+static void bench_fb_post(const format_t& f, const resolution_t& res,
+        int threads, const char* name)
+{
+    if (!strcmp(name, "fb_post_thp"))
+        property_set("ro.boot.redroid_gralloc_hugepage", "thp");
+    const bool convert = !strcmp(name, "fb_post_convert");
+    char value[PROPERTY_VALUE_MAX];
+    snprintf(value, sizeof(value), "%d", threads);
+    property_set("ro.boot.redroid_fb_copy_threads", value);
+    // a single screen: every post is copied
+    property_set("ro.boot.redroid_fb_buffers", "1");
+    property_set("ro.boot.redroid_fb_damage", "off");
+    property_set("ro.boot.redroid_fb_export", "off");
+    fakeFbSetup(res.width, res.height, f.fbBpp);
+
+    hw_module_t* hw = &HAL_MODULE_INFO_SYM.common;
+    framebuffer_device_t* fb = 0;
+    int err = hw->methods->open(hw, GRALLOC_HARDWARE_FB0, (hw_device_t**)&fb);
+    if (err) {
+        report_error(name, f.name, res, threads, err);
+        return;
+    }
+    fb->setSwapInterval(fb, 0);
+
+    alloc_device_t* dev = open_alloc();
+    gralloc_module_t* module = &HAL_MODULE_INFO_SYM;
+    buffer_handle_t handle;
+    int stride;
+    const int format = convert ? HAL_PIXEL_FORMAT_RGBA_FP16 : fb->format;
+    const size_t bpp = convert ? 8 : f.fbBpp / 8;
+    err = dev->alloc(dev, fb->width, fb->height, format,
+            GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_SW_WRITE_OFTEN,
+            &handle, &stride);
+    if (err) {
+        report_error(name, f.name, res, threads, err);
+        return;
+    }
+    void* vaddr;
+    module->lock(module, handle, GRALLOC_USAGE_SW_WRITE_OFTEN,
+            0, 0, fb->width, fb->height, &vaddr);
+    memset(vaddr, 0x3a, size_t(stride) * fb->height * bpp);
+    module->unlock(module, handle);
+
+    const uint64_t frameBytes = uint64_t(fb->width) * fb->height * (f.fbBpp / 8);
+    result_t r = run_threads(1, [&](int) -> uint64_t {
+        return fb->post(fb, handle) == 0 ? frameBytes : 0;
+    });
+    report(name, f.name, res, threads, r);
+
+    dev->free(dev, handle);
+    fb->common.close(&fb->common);
+}
+
+// partial posts through the fake fbdev, checking after every one that the
+// screen shows the posted buffer: fb_check_damage alternates two buffers with
+// damage tracking on, fb_check_update_rect sets the written rectangle as the
+// update rect, fb_check_flip posts framebuffer slots. Each post rewrites a
+// random rectangle of its buffer. Fails with EIO on the first mismatch.
+static void bench_fb_check(const format_t& f, const resolution_t& res,
+        const char* name)
+{
+    const bool flip = !strcmp(name, "fb_check_flip");
+    const bool updateRect = !strcmp(name, "fb_check_update_rect");
+    property_set("ro.boot.redroid_fb_buffers", flip ? "2" : "1");
+    property_set("ro.boot.redroid_fb_damage",
+            !strcmp(name, "fb_check_damage") ? "uffd" : "off");
+    property_set("ro.boot.redroid_fb_export", "off");
+    fakeFbSetup(res.width, res.height, f.fbBpp);
+
+    hw_module_t* hw = &HAL_MODULE_INFO_SYM.common;
+    framebuffer_device_t* fb = 0;
+    int err = hw->methods->open(hw, GRALLOC_HARDWARE_FB0, (hw_device_t**)&fb);
+    if (err) {
+        report_error(name, f.name, res, 1, err);
+        return;
+    }
+    fb->setSwapInterval(fb, 0);
+
+    alloc_device_t* dev = open_alloc();
+    gralloc_module_t* module = &HAL_MODULE_INFO_SYM;
+    const int usage = (flip ? GRALLOC_USAGE_HW_FB : GRALLOC_USAGE_HW_COMPOSER) |
+            GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN;
+    // with two framebuffer slots the third HW_FB buffer is a regular one,
+    // posting it copies into the first screen and shows that one again
+    const int numBuffers = updateRect ? 1 : flip ? 3 : 2;
+    buffer_handle_t handles[3];
+    int strides[3];
+    for (int i = 0; i < numBuffers; i++) {
+        err = dev->alloc(dev, fb->width, fb->height, fb->format, usage,
+                &handles[i], &strides[i]);
+        if (err) {
+            report_error(name, f.name, res, 1, err);
+            return;
+        }
+    }
+
+    const size_t bpp = f.fbBpp / 8;
+    const size_t rowBytes = fb->width * bpp;
+    const size_t screenStride = fb->stride * bpp;
+    std::vector<uint8_t> screen(screenStride * fb->height);
+    uint64_t posts = 0;
+    srand(1);
+    result_t r = run_threads(1, [&](int) -> uint64_t {
+        if (err)
+            return 0;
+        const int i = posts % numBuffers;
+        const bool first = posts++ < uint64_t(numBuffers);
+        const size_t stride = strides[i] * bpp;
+        int l = 0, t = 0, w = fb->width, h = fb->height;
+        if (!first) {
+            l = rand() % fb->width;
+            t = rand() % fb->height;
+            w = 1 + rand() % (fb->width - l);
+            h = 1 + rand() % (fb->height - t);
+        }
+
+        void* vaddr;
+        err = module->lock(module, handles[i], GRALLOC_USAGE_SW_WRITE_OFTEN,
+                l, t, w, h, &vaddr);
+        if (err)
+            return 0;
+        const uint8_t value = rand();
+        for (int y = t; y < t + h; y++)
+            memset((uint8_t*)vaddr + y * stride + l * bpp, value + y, w * bpp);
+        module->unlock(module, handles[i]);
+
+        if (updateRect && !first)
+            fb->setUpdateRect(fb, l, t, w, h);
+        err = fb->post(fb, handles[i]);
+        if (err)
+            return 0;
+
+        if (fakeFbScanout(screen.data(), screen.size()) != screen.size()) {
+            err = -EIO;
+            return 0;
+        }
+        err = module->lock(module, handles[i], GRALLOC_USAGE_SW_READ_OFTEN,
+                0, 0, fb->width, fb->height, &vaddr);
+        if (err)
+            return 0;
+        for (size_t y = 0; y < fb->height && !err; y++) {
+            if (memcmp(screen.data() + y * screenStride,
+                    (const uint8_t*)vaddr + y * stride, rowBytes))
+                err = -EIO;
+        }
+        module->unlock(module, handles[i]);
+        return size_t(w) * h * bpp;
+    });
+    if (err)
+        report_error(name, f.name, res, 1, err);
+    else
+        report(name, f.name, res, 1, r);
+
+    for (int i = 0; i < numBuffers; i++)
+        dev->free(dev, handles[i]);
+    fb->common.close(&fb->common);
+}
+
+/*****************************************************************************/
+
+int main(int argc, char** argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        switch (opt) {
+            case 'd':
+                sDurationNs = atoll(optarg) * 1000000LL;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-d ms] [name-filter]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc)
+        sFilter = argv[optind];
+
+    const resolution_t& fhd = sResolutions[1];
+    for (const format_t& f : sFormats) {
+        for (int threads : sThreadCounts) {
+            run_case("alloc_free", [&] { bench_alloc_free(f, fhd, threads); });
+        }
+    }
+    for (const format_t& f : sFormats) {
+        for (int threads : sThreadCounts) {
+            run_case("register_unregister", [&] { bench_register(f, fhd, threads); });
+            run_case("lock_unlock", [&] { bench_lock(f, fhd, threads, false); });
+            run_case("lock_unlock_traced",
+                    [&] { bench_lock(f, fhd, threads, true); });
+            run_case("lockAsync_unlockAsync",
+                    [&] { bench_lock_async(f, fhd, threads); });
+        }
+    }
+    for (const format_t& f : sFormats) {
+        for (int threads : sThreadCounts) {
+            for (const char* name : { "alloc_write", "alloc_write_nopolicy",
+                    "alloc_write_thp" }) {
+                run_case(name, [&] { bench_alloc_write(f, fhd, threads, name); });
+            }
+        }
+    }
+    for (const format_t& f : sFormats) {
+        for (int threads : sThreadCounts) {
+            run_case("stress", [&] { bench_stress(f, fhd, threads); });
+        }
+    }
+    for (const format_t& src : sConvertFormats) {
+        for (const format_t& dst : sConvertFormats) {
+            if (dst.fbBpp && convertSupported(src.format, dst.format))
+                run_case("convert", [&] { bench_convert(src, dst, fhd); });
+        }
+    }
+    for (const resolution_t& res : sResolutions) {
+        for (const format_t& f : sFormats) {
+            if (!f.fbBpp)
+                continue;
+            for (int threads : sThreadCounts) {
+                for (const char* name : { "fb_post", "fb_post_thp",
+                        "fb_post_convert" }) {
+                    run_case(name, [&] { bench_fb_post(f, res, threads, name); });
+                }
+            }
+        }
+    }
+    for (const format_t& f : sFormats) {
+        if (!f.fbBpp)
+            continue;
+        for (const char* name : { "fb_check_damage", "fb_check_update_rect",
+                "fb_check_flip" }) {
+            run_case(name, [&] { bench_fb_check(f, fhd, name); });
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GRALLOC_BENCH_H_
+#define GRALLOC_BENCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*****************************************************************************/
+
+// host stand-ins, see stubs.cpp
+
+// makes /dev/graphics/fb0 open a memfd-backed device of that geometry, with
+// 16 (RGB_565) or 32 (RGBX_8888) bits per pixel
+void fakeFbSetup(uint32_t xres, uint32_t yres, uint32_t bpp);
+
+// copies what the fake fbdev shows, the screen at its yoffset, into 'dst'.
+// Returns the number of bytes read.
+size_t fakeFbScanout(void* dst, size_t len);
+
+// sw_sync stand-in: a fence that polls readable once signaled
+int fakeFenceCreate();
+void fakeFenceSignal(int fence);
+
+// turns the atrace graphics tag on or off, the markers go to /dev/null
+void fakeTraceEnable(bool enable);
+
+// clears the properties set with property_set()
+void resetProperties();
+
+#endif /* GRALLOC_BENCH_H_ */
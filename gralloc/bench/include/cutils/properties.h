@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* host stand-in for libcutils' properties.h, see stubs.cpp */
+
+#ifndef __CUTILS_PROPERTIES_H
+#define __CUTILS_PROPERTIES_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#define PROPERTY_KEY_MAX    32
+#define PROPERTY_VALUE_MAX  92
+
+__BEGIN_DECLS
+
+int property_get(const char* key, char* value, const char* default_value);
+int property_set(const char* key, const char* value);
+int8_t property_get_bool(const char* key, int8_t default_value);
+int64_t property_get_int64(const char* key, int64_t default_value);
+int32_t property_get_int32(const char* key, int32_t default_value);
+
+__END_DECLS
+
+#endif /* __CUTILS_PROPERTIES_H */
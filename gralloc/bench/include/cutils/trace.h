@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* host stand-in for libcutils' trace.h, see stubs.cpp */
+
+#ifndef _LIBS_CUTILS_TRACE_H
+#define _LIBS_CUTILS_TRACE_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#define ATRACE_TAG_NEVER    0
+#define ATRACE_TAG_GRAPHICS (1 << 1)
+
+__BEGIN_DECLS
+
+extern uint64_t atrace_enabled_tags;
+
+static inline uint64_t atrace_is_tag_enabled(uint64_t tag)
+{
+    return __atomic_load_n(&atrace_enabled_tags, __ATOMIC_ACQUIRE) & tag;
+}
+
+void atrace_begin(uint64_t tag, const char* name);
+void atrace_end(uint64_t tag);
+void atrace_int64(uint64_t tag, const char* name, int64_t value);
+
+__END_DECLS
+
+#endif /* _LIBS_CUTILS_TRACE_H */
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* host stand-in for libhardware's gralloc.h */
+
+#ifndef ANDROID_GRALLOC_INTERFACE_H
+#define ANDROID_GRALLOC_INTERFACE_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <system/graphics.h>
+#include <hardware/hardware.h>
+#include <hardware/fb.h>
+
+__BEGIN_DECLS
+
+#define GRALLOC_MODULE_API_VERSION_0_1  HARDWARE_MODULE_API_VERSION(0, 1)
+#define GRALLOC_MODULE_API_VERSION_0_2  HARDWARE_MODULE_API_VERSION(0, 2)
+#define GRALLOC_MODULE_API_VERSION_0_3  HARDWARE_MODULE_API_VERSION(0, 3)
+
+#define GRALLOC_HARDWARE_MODULE_ID "gralloc"
+#define GRALLOC_HARDWARE_GPU0 "gpu0"
+
+enum {
+    GRALLOC_USAGE_SW_READ_NEVER         = 0x00000000U,
+    GRALLOC_USAGE_SW_READ_RARELY        = 0x00000002U,
+    GRALLOC_USAGE_SW_READ_OFTEN         = 0x00000003U,
+    GRALLOC_USAGE_SW_READ_MASK          = 0x0000000FU,
+    GRALLOC_USAGE_SW_WRITE_NEVER        = 0x00000000U,
+    GRALLOC_USAGE_SW_WRITE_RARELY       = 0x00000020U,
+    GRALLOC_USAGE_SW_WRITE_OFTEN        = 0x00000030U,
+    GRALLOC_USAGE_SW_WRITE_MASK         = 0x000000F0U,
+    GRALLOC_USAGE_HW_TEXTURE            = 0x00000100U,
+    GRALLOC_USAGE_HW_RENDER             = 0x00000200U,
+    GRALLOC_USAGE_HW_2D                 = 0x00000400U,
+    GRALLOC_USAGE_HW_COMPOSER           = 0x00000800U,
+    GRALLOC_USAGE_HW_FB                 = 0x00001000U,
+    GRALLOC_USAGE_EXTERNAL_DISP         = 0x00002000U,
+    GRALLOC_USAGE_PROTECTED             = 0x00004000U,
+    GRALLOC_USAGE_CURSOR                = 0x00008000U,
+    GRALLOC_USAGE_HW_VIDEO_ENCODER      = 0x00010000U,
+    GRALLOC_USAGE_HW_CAMERA_WRITE       = 0x00020000U,
+    GRALLOC_USAGE_HW_CAMERA_READ        = 0x00040000U,
+    GRALLOC_USAGE_HW_CAMERA_ZSL         = 0x00060000U,
+    GRALLOC_USAGE_HW_CAMERA_MASK        = 0x00060000U,
+    GRALLOC_USAGE_HW_MASK               = 0x00071F00U,
+    GRALLOC_USAGE_RENDERSCRIPT          = 0x00100000U,
+    GRALLOC_USAGE_FOREIGN_BUFFERS       = 0x00200000U,
+    GRALLOC_USAGE_HW_IMAGE_ENCODER      = 0x08000000U,
+    GRALLOC_USAGE_PRIVATE_0             = 0x10000000U,
+    GRALLOC_USAGE_PRIVATE_1             = 0x20000000U,
+    GRALLOC_USAGE_PRIVATE_2             = 0x40000000U,
+    GRALLOC_USAGE_PRIVATE_3             = 0x80000000U,
+    GRALLOC_USAGE_PRIVATE_MASK          = 0xF0000000U,
+};
+
+typedef struct gralloc_module_t {
+    struct hw_module_t common;
+
+    int (*registerBuffer)(struct gralloc_module_t const* module,
+            buffer_handle_t handle);
+    int (*unregisterBuffer)(struct gralloc_module_t const* module,
+            buffer_handle_t handle);
+    int (*lock)(struct gralloc_module_t const* module,
+            buffer_handle_t handle, int usage,
+            int l, int t, int w, int h,
+            void** vaddr);
+    int (*unlock)(struct gralloc_module_t const* module,
+            buffer_handle_t handle);
+    int (*perform)(struct gralloc_module_t const* module,
+            int operation, ... );
+    int (*lock_ycbcr)(struct gralloc_module_t const* module,
+            buffer_handle_t handle, int usage,
+            int l, int t, int w, int h,
+            struct android_ycbcr *ycbcr);
+    int (*lockAsync)(struct gralloc_module_t const* module,
+            buffer_handle_t handle, int usage,
+            int l, int t, int w, int h,
+            void** vaddr, int fenceFd);
+    int (*unlockAsync)(struct gralloc_module_t const* module,
+            buffer_handle_t handle, int* fenceFd);
+    int (*lockAsync_ycbcr)(struct gralloc_module_t const* module,
+            buffer_handle_t handle, int usage,
+            int l, int t, int w, int h,
+            struct android_ycbcr *ycbcr, int fenceFd);
+    int32_t (*getTransportSize)(struct gralloc_module_t const* module,
+            buffer_handle_t handle, uint32_t *outNumFds,
+            uint32_t *outNumInts);
+    int32_t (*validateBufferSize)(struct gralloc_module_t const* device,
+            buffer_handle_t handle, uint32_t w, uint32_t h, int32_t format,
+            int usage, uint32_t stride);
+    void* reserved_proc[1];
+} gralloc_module_t;
+
+typedef struct alloc_device_t {
+    struct hw_device_t common;
+
+    int (*alloc)(struct alloc_device_t* dev,
+            int w, int h, int format, int usage,
+            buffer_handle_t* handle, int* stride);
+    int (*free)(struct alloc_device_t* dev,
+            buffer_handle_t handle);
+    void (*dump)(struct alloc_device_t *dev, char *buff, int buff_len);
+    void* reserved_proc[7];
+} alloc_device_t;
+
+__END_DECLS
+
+#endif  // ANDROID_GRALLOC_INTERFACE_H
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* host stand-in for liblog, messages go to stderr when GRALLOC_BENCH_LOG is set */
+
+#ifndef _LIBS_LOG_LOG_H
+#define _LIBS_LOG_LOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/cdefs.h>
+
+#ifndef LOG_TAG
+#define LOG_TAG NULL
+#endif
+
+__BEGIN_DECLS
+
+int __bench_log_enabled(void);
+
+__END_DECLS
+
+#define __ALOG(prio, ...) \
+    (__bench_log_enabled() ? (fprintf(stderr, prio "/%s: ", LOG_TAG), \
+            fprintf(stderr, __VA_ARGS__), fprintf(stderr, "\n"), (void)0) : (void)0)
+
+#define ALOGV(...) ((void)0)
+#define ALOGD(...) __ALOG("D", __VA_ARGS__)
+#define ALOGI(...) __ALOG("I", __VA_ARGS__)
+#define ALOGW(...) __ALOG("W", __VA_ARGS__)
+#define ALOGE(...) __ALOG("E", __VA_ARGS__)
+
+#define ALOGD_IF(cond, ...) ((cond) ? ALOGD(__VA_ARGS__) : (void)0)
+#define ALOGI_IF(cond, ...) ((cond) ? ALOGI(__VA_ARGS__) : (void)0)
+#define ALOGW_IF(cond, ...) ((cond) ? ALOGW(__VA_ARGS__) : (void)0)
+#define ALOGE_IF(cond, ...) ((cond) ? ALOGE(__VA_ARGS__) : (void)0)
+
+#define LOG_ALWAYS_FATAL_IF(cond, ...) \
+    ((cond) ? (ALOGE(__VA_ARGS__), abort()) : (void)0)
+
+#endif /* _LIBS_LOG_LOG_H */
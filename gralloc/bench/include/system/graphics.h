@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* host stand-in for the parts of system/graphics.h used by the HAL */
+
+#ifndef SYSTEM_CORE_GRAPHICS_H
+#define SYSTEM_CORE_GRAPHICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+__BEGIN_DECLS
+
+typedef enum android_pixel_format {
+    HAL_PIXEL_FORMAT_RGBA_8888 = 1,
+    HAL_PIXEL_FORMAT_RGBX_8888 = 2,
+    HAL_PIXEL_FORMAT_RGB_888 = 3,
+    HAL_PIXEL_FORMAT_RGB_565 = 4,
+    HAL_PIXEL_FORMAT_BGRA_8888 = 5,
+    HAL_PIXEL_FORMAT_YCBCR_422_SP = 0x10,
+    HAL_PIXEL_FORMAT_YCRCB_420_SP = 0x11,
+    HAL_PIXEL_FORMAT_YCBCR_422_I = 0x14,
+    HAL_PIXEL_FORMAT_RGBA_FP16 = 0x16,
+    HAL_PIXEL_FORMAT_RAW16 = 0x20,
+    HAL_PIXEL_FORMAT_BLOB = 0x21,
+    HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED = 0x22,
+    HAL_PIXEL_FORMAT_YCBCR_420_888 = 0x23,
+    HAL_PIXEL_FORMAT_RGBA_1010102 = 0x2B,
+    HAL_PIXEL_FORMAT_YV12 = 0x32315659,
+} android_pixel_format_t;
+
+struct android_ycbcr {
+    void *y;
+    void *cb;
+    void *cr;
+    size_t ystride;
+    size_t cstride;
+    size_t chroma_step;
+    uint32_t reserved[8];
+};
+
+__END_DECLS
+
+#endif /* SYSTEM_CORE_GRAPHICS_H */
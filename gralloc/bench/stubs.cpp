@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/fb.h>
+
+#include <map>
+#include <string>
+
+#include <cutils/ashmem.h>
+#include <cutils/properties.h>
+#include <cutils/trace.h>
+#include <log/log.h>
+
+#include "bench.h"
+
+/*****************************************************************************/
+
+// libcutils properties, kept in memory
+
+static pthread_mutex_t sPropertyLock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, std::string> sProperties;
+
+int property_get(const char* key, char* value, const char* default_value)
+{
+    pthread_mutex_lock(&sPropertyLock);
+    auto it = sProperties.find(key);
+    const char* v = it != sProperties.end() ? it->second.c_str() :
+            default_value ? default_value : "";
+    strncpy(value, v, PROPERTY_VALUE_MAX - 1);
+    value[PROPERTY_VALUE_MAX - 1] = 0;
+    pthread_mutex_unlock(&sPropertyLock);
+    return strlen(value);
+}
+
+int property_set(const char* key, const char* value)
+{
+    pthread_mutex_lock(&sPropertyLock);
+    sProperties[key] = value;
+    pthread_mutex_unlock(&sPropertyLock);
+    return 0;
+}
+
+void resetProperties()
+{
+    pthread_mutex_lock(&sPropertyLock);
+    sProperties.clear();
+    pthread_mutex_unlock(&sPropertyLock);
+}
+
+int8_t property_get_bool(const char* key, int8_t default_value)
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get(key, value, "");
+    if (!strcmp(value, "1") || !strcmp(value, "y") || !strcmp(value, "yes") ||
+            !strcmp(value, "on") || !strcmp(value, "true"))
+        return 1;
+    if (!strcmp(value, "0") || !strcmp(value, "n") || !strcmp(value, "no") ||
+            !strcmp(value, "off") || !strcmp(value, "false"))
+        return 0;
+    return default_value;
+}
+
+int64_t property_get_int64(const char* key, int64_t default_value)
+{
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get(key, value, "") == 0)
+        return default_value;
+    char* end;
+    errno = 0;
+    int64_t result = strtoll(value, &end, 0);
+    return (errno || *end) ? default_value : result;
+}
+
+int32_t property_get_int32(const char* key, int32_t default_value)
+{
+    return property_get_int64(key, default_value);
+}
+
+/*****************************************************************************/
+
+// liblog
+
+int __bench_log_enabled(void)
+{
+    static int enabled = getenv("GRALLOC_BENCH_LOG") != 0;
+    return enabled;
+}
+
+/*****************************************************************************/
+
+// libcutils trace: the markers are written to /dev/null, a write per event
+// as with trace_marker
+
+uint64_t atrace_enabled_tags;
+static int sTraceFd = -1;
+
+void fakeTraceEnable(bool enable)
+{
+    if (enable && sTraceFd < 0)
+        sTraceFd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    __atomic_store_n(&atrace_enabled_tags, enable ? ~0ULL : 0, __ATOMIC_RELEASE);
+}
+
+static void fake_trace_write(const char* fmt, ...)
+{
+    char buf[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len > int(sizeof(buf)) - 1)
+        len = sizeof(buf) - 1;
+    if (write(sTraceFd, buf, len) < 0)
+        return;
+}
+
+void atrace_begin(uint64_t tag, const char* name)
+{
+    if (atrace_is_tag_enabled(tag))
+        fake_trace_write("B|%d|%s", getpid(), name);
+}
+
+void atrace_end(uint64_t tag)
+{
+    if (atrace_is_tag_enabled(tag))
+        fake_trace_write("E|%d", getpid());
+}
+
+void atrace_int64(uint64_t tag, const char* name, int64_t value)
+{
+    if (atrace_is_tag_enabled(tag))
+        fake_trace_write("C|%d|%s|%lld", getpid(), name, (long long)value);
+}
+
+/*****************************************************************************/
+
+// libcutils ashmem, backed by memfd
+
+int ashmem_valid(int /*fd*/)
+{
+    return 0;
+}
+
+int ashmem_create_region(const char* name, size_t size)
+{
+    int fd = syscall(__NR_memfd_create, name, MFD_CLOEXEC);
+    if (fd >= 0 && ftruncate(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int ashmem_set_prot_region(int /*fd*/, int /*prot*/)
+{
+    return 0;
+}
+
+int ashmem_pin_region(int /*fd*/, size_t /*offset*/, size_t /*len*/)
+{
+    return ASHMEM_NOT_PURGED;
+}
+
+int ashmem_unpin_region(int /*fd*/, size_t /*offset*/, size_t /*len*/)
+{
+    return ASHMEM_IS_UNPINNED;
+}
+
+int ashmem_get_size_region(int fd)
+{
+    return lseek(fd, 0, SEEK_END);
+}
+
+/*****************************************************************************/
+
+// sw_sync needs debugfs and CONFIG_SW_SYNC, an eventfd polls the same way a
+// sync_file does: readable once signaled
+
+int fakeFenceCreate()
+{
+    return eventfd(0, EFD_CLOEXEC);
+}
+
+void fakeFenceSignal(int fence)
+{
+    uint64_t one = 1;
+    if (write(fence, &one, sizeof(one)) < 0)
+        ALOGE("couldn't signal fence %d (%s)", fence, strerror(errno));
+}
+
+/*****************************************************************************/
+
+// Fake fbdev: open() and ioctl() are interposed, /dev/graphics/fb0 opens a
+// memfd and the fb ioctls are answered from the geometry given to
+// fakeFbSetup(). Without a setup the HAL falls back to its virtual
+// framebuffer.
+
+static struct {
+    bool enabled;
+    int fd;
+    struct fb_var_screeninfo info;
+    struct fb_fix_screeninfo finfo;
+} sFakeFb = { false, -1, {}, {} };
+
+void fakeFbSetup(uint32_t xres, uint32_t yres, uint32_t bpp)
+{
+    struct fb_var_screeninfo& info = sFakeFb.info;
+    memset(&info, 0, sizeof(info));
+    info.xres = xres;
+    info.yres = yres;
+    info.xres_virtual = xres;
+    info.yres_virtual = yres;
+    info.bits_per_pixel = bpp;
+    if (bpp == 16) {
+        info.red.offset = 11;
+        info.red.length = 5;
+        info.green.offset = 5;
+        info.green.length = 6;
+        info.blue.offset = 0;
+        info.blue.length = 5;
+    } else {
+        info.red.length = 8;
+        info.green.offset = 8;
+        info.green.length = 8;
+        info.blue.offset = 16;
+        info.blue.length = 8;
+    }
+
+    struct fb_fix_screeninfo& finfo = sFakeFb.finfo;
+    memset(&finfo, 0, sizeof(finfo));
+    strncpy(finfo.id, "benchfb", sizeof(finfo.id));
+    // like most drivers, pad the lines to 64 bytes
+    finfo.line_length = (xres * (bpp / 8) + 63) & ~63;
+    finfo.smem_len = finfo.line_length * yres;
+    sFakeFb.enabled = true;
+}
+
+static int fake_fb_open()
+{
+    int fd = syscall(__NR_memfd_create, "benchfb", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, sFakeFb.finfo.smem_len) < 0) {
+        close(fd);
+        return -1;
+    }
+    sFakeFb.fd = fd;
+    return fd;
+}
+
+static int fake_fb_ioctl(unsigned long request, void* arg)
+{
+    switch (request) {
+        case FBIOGET_FSCREENINFO:
+            memcpy(arg, &sFakeFb.finfo, sizeof(sFakeFb.finfo));
+            return 0;
+        case FBIOGET_VSCREENINFO:
+            memcpy(arg, &sFakeFb.info, sizeof(sFakeFb.info));
+            return 0;
+        case FBIOPUT_VSCREENINFO:
+        case FBIOPAN_DISPLAY: {
+            const struct fb_var_screeninfo* info =
+                    (const struct fb_var_screeninfo*)arg;
+            const size_t len = size_t(sFakeFb.finfo.line_length) *
+                    info->yres_virtual;
+            if (info->yres_virtual > sFakeFb.info.yres_virtual) {
+                if (ftruncate(sFakeFb.fd, len) < 0)
+                    return -1;
+                sFakeFb.info.yres_virtual = info->yres_virtual;
+                sFakeFb.finfo.smem_len = len;
+            }
+            sFakeFb.info.yoffset = info->yoffset;
+            return 0;
+        }
+    }
+    errno = ENOTTY;
+    return -1;
+}
+
+size_t fakeFbScanout(void* dst, size_t len)
+{
+    const off_t offset = off_t(sFakeFb.finfo.line_length) * sFakeFb.info.yoffset;
+    ssize_t n = pread(sFakeFb.fd, dst, len, offset);
+    return n < 0 ? 0 : n;
+}
+
+// the HAL keeps a dup of the fd it opened
+static bool is_fake_fb(int fd)
+{
+    struct stat st, fake;
+    return sFakeFb.fd >= 0 && fstat(fd, &st) == 0 &&
+            fstat(sFakeFb.fd, &fake) == 0 &&
+            st.st_dev == fake.st_dev && st.st_ino == fake.st_ino;
+}
+
+extern "C" int open(const char* path, int flags, ...)
+{
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, int);
+        va_end(args);
+    }
+    if (sFakeFb.enabled && !strcmp(path, "/dev/graphics/fb0"))
+        return fake_fb_open();
+    return syscall(__NR_openat, AT_FDCWD, path, flags, mode);
+}
+
+extern "C" int ioctl(int fd, unsigned long request, ...)
+{
+    va_list args;
+    va_start(args, request);
+    void* arg = va_arg(args, void*);
+    va_end(args);
+    if (sFakeFb.enabled && is_fake_fb(fd))
+        return fake_fb_ioctl(request, arg);
+    return syscall(__NR_ioctl, fd, request, arg);
+}
@@ -0,0 +1,526 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*****************************************************************************/
+
+// Pixel format conversion for fb_post, when a client posts a buffer whose
+// format isn't the framebuffer's. Every source layout is decoded to RGBA
+// bytes and encoded to the destination layout by blocks that stay in L1,
+// so five kernels cover every pair:
+//
+//   swap_rb   RGBA <-> BGRA
+//   rgb888    RGB_888 -> RGBA
+//   rgb565    RGB_565 -> RGBA
+//   fp16      RGBA_FP16 -> RGBA
+//   pack565   RGBA -> RGB_565
+//
+// The scalar kernels are the reference, the SIMD ones must match them bit
+// for bit (see the "convert" case of the bench). RGBX is taken as RGBA:
+// its X byte becomes the alpha of a BGRA destination.
+
+// "scalar" forces the reference kernels
+#define CONVERT_KERNEL_PROP "ro.boot.redroid_fb_convert"
+
+// pixels decoded at once, 1 KiB of RGBA
+#define CONVERT_BLOCK 256
+
+enum {
+    LAYOUT_NONE = 0,
+    LAYOUT_RGBA8,
+    LAYOUT_BGRA8,
+    LAYOUT_RGB888,
+    LAYOUT_RGB565,
+    LAYOUT_FP16,
+};
+
+typedef void (*row_fn_t)(uint8_t* dst, const uint8_t* src, size_t n);
+
+struct convert_kernels_t {
+    const char* name;
+    row_fn_t swapRb;
+    row_fn_t rgb888;
+    row_fn_t rgb565;
+    row_fn_t fp16;
+    row_fn_t pack565;
+};
+
+static int format_layout(int format)
+{
+    switch (format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+            return LAYOUT_RGBA8;
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+            return LAYOUT_BGRA8;
+        case HAL_PIXEL_FORMAT_RGB_888:
+            return LAYOUT_RGB888;
+        case HAL_PIXEL_FORMAT_RGB_565:
+            return LAYOUT_RGB565;
+        case HAL_PIXEL_FORMAT_RGBA_FP16:
+            return LAYOUT_FP16;
+        default:
+            return LAYOUT_NONE;
+    }
+}
+
+/*****************************************************************************/
+
+// reference kernels
+
+static void swap_rb_scalar(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    for (size_t i = 0; i < n; i++, dst += 4, src += 4) {
+        const uint8_t r = src[0];
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = r;
+        dst[3] = src[3];
+    }
+}
+
+static void rgb888_scalar(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    for (size_t i = 0; i < n; i++, dst += 4, src += 3) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = 0xff;
+    }
+}
+
+static void rgb565_scalar(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    for (size_t i = 0; i < n; i++, dst += 4, src += 2) {
+        const uint16_t p = src[0] | (src[1] << 8);
+        const uint8_t r = p >> 11, g = (p >> 5) & 0x3f, b = p & 0x1f;
+        dst[0] = (r << 3) | (r >> 2);
+        dst[1] = (g << 2) | (g >> 4);
+        dst[2] = (b << 3) | (b >> 2);
+        dst[3] = 0xff;
+    }
+}
+
+static float half_to_float(uint16_t h)
+{
+    const uint32_t sign = uint32_t(h & 0x8000) << 16;
+    const uint32_t exp = (h >> 10) & 0x1f;
+    const uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (mant << 13);        // inf, nan
+    } else if (exp) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else {
+        // zero or subnormal, exact in single precision
+        float f = ldexpf(float(mant), -24);
+        return sign ? -f : f;
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// clamps to [0, 1] (NaN to 0) and rounds to nearest even, as the SIMD
+// min/max and conversion instructions do
+static uint8_t unorm8(float v)
+{
+    v = v > 0.0f ? v : 0.0f;
+    v = v < 1.0f ? v : 1.0f;
+    return uint8_t(lrintf(v * 255.0f));
+}
+
+static void fp16_scalar(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    for (size_t i = 0; i < n * 4; i++, src += 2)
+        dst[i] = unorm8(half_to_float(src[0] | (src[1] << 8)));
+}
+
+static void pack565_scalar(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    for (size_t i = 0; i < n; i++, dst += 2, src += 4) {
+        const uint16_t p = ((src[0] >> 3) << 11) | ((src[1] >> 2) << 5) |
+                (src[2] >> 3);
+        dst[0] = p & 0xff;
+        dst[1] = p >> 8;
+    }
+}
+
+static const convert_kernels_t sScalarKernels = {
+    "scalar",
+    swap_rb_scalar,
+    rgb888_scalar,
+    rgb565_scalar,
+    fp16_scalar,
+    pack565_scalar,
+};
+
+/*****************************************************************************/
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("ssse3")))
+static void swap_rb_ssse3(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+            10, 9, 8, 11, 14, 13, 12, 15);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_shuffle_epi8(v, mask));
+    }
+    swap_rb_scalar(dst + i * 4, src + i * 4, n - i);
+}
+
+__attribute__((target("avx2")))
+static void swap_rb_avx2(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    const __m256i mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+            10, 9, 8, 11, 14, 13, 12, 15,
+            2, 1, 0, 3, 6, 5, 4, 7,
+            10, 9, 8, 11, 14, 13, 12, 15);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_shuffle_epi8(v, mask));
+    }
+    swap_rb_scalar(dst + i * 4, src + i * 4, n - i);
+}
+
+__attribute__((target("ssse3")))
+static void rgb888_ssse3(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    // 4 pixels out of 12 bytes, the alpha bytes zeroed then set
+    const __m128i mask = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+            6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const uint8_t* s = src + i * 3;
+        __m128i a = _mm_loadu_si128((const __m128i*)(s + 0));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(s + 32));
+        __m128i p0 = a;
+        __m128i p1 = _mm_alignr_epi8(b, a, 12);
+        __m128i p2 = _mm_alignr_epi8(c, b, 8);
+        __m128i p3 = _mm_srli_si128(c, 4);
+        __m128i* d = (__m128i*)(dst + i * 4);
+        _mm_storeu_si128(d + 0, _mm_or_si128(_mm_shuffle_epi8(p0, mask), alpha));
+        _mm_storeu_si128(d + 1, _mm_or_si128(_mm_shuffle_epi8(p1, mask), alpha));
+        _mm_storeu_si128(d + 2, _mm_or_si128(_mm_shuffle_epi8(p2, mask), alpha));
+        _mm_storeu_si128(d + 3, _mm_or_si128(_mm_shuffle_epi8(p3, mask), alpha));
+    }
+    rgb888_scalar(dst + i * 4, src + i * 3, n - i);
+}
+
+__attribute__((target("sse2")))
+static void rgb565_sse2(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    const __m128i mask5 = _mm_set1_epi16(0x1f);
+    const __m128i mask6 = _mm_set1_epi16(0x3f);
+    const __m128i alpha = _mm_set1_epi16(int16_t(0xff00));
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 2));
+        __m128i r = _mm_srli_epi16(v, 11);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(v, 5), mask6);
+        __m128i b = _mm_and_si128(v, mask5);
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+        // R | G << 8 and B | A << 8, interleaved into RGBA
+        __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+        __m128i ba = _mm_or_si128(b, alpha);
+        __m128i* d = (__m128i*)(dst + i * 4);
+        _mm_storeu_si128(d + 0, _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128(d + 1, _mm_unpackhi_epi16(rg, ba));
+    }
+    rgb565_scalar(dst + i * 4, src + i * 2, n - i);
+}
+
+__attribute__((target("sse2,f16c")))
+static __m128i fp16_pixel(const uint8_t* src)
+{
+    __m128 v = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)src));
+    // max() returns its second operand for a NaN
+    v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+    return _mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(255.0f)));
+}
+
+__attribute__((target("sse2,f16c")))
+static void fp16_f16c(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const uint8_t* s = src + i * 8;
+        __m128i lo = _mm_packs_epi32(fp16_pixel(s), fp16_pixel(s + 8));
+        __m128i hi = _mm_packs_epi32(fp16_pixel(s + 16), fp16_pixel(s + 24));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(lo, hi));
+    }
+    fp16_scalar(dst + i * 4, src + i * 8, n - i);
+}
+
+__attribute__((target("ssse3")))
+static __m128i pack565_quad(__m128i p)
+{
+    __m128i r = _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xf8)), 8);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x7e0));
+    __m128i b = _mm_and_si128(_mm_srli_epi32(p, 19), _mm_set1_epi32(0x1f));
+    // the low halves of the 4 lanes, in the low 8 bytes
+    const __m128i mask = _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13,
+            -1, -1, -1, -1, -1, -1, -1, -1);
+    return _mm_shuffle_epi8(_mm_or_si128(_mm_or_si128(r, g), b), mask);
+}
+
+__attribute__((target("ssse3")))
+static void pack565_ssse3(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = pack565_quad(_mm_loadu_si128((const __m128i*)(src + i * 4)));
+        __m128i b = pack565_quad(_mm_loadu_si128((const __m128i*)(src + i * 4 + 16)));
+        _mm_storeu_si128((__m128i*)(dst + i * 2), _mm_unpacklo_epi64(a, b));
+    }
+    pack565_scalar(dst + i * 2, src + i * 4, n - i);
+}
+
+#elif defined(__aarch64__)
+
+static void swap_rb_neon(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x4_t v = vld4q_u8(src + i * 4);
+        uint8x16_t r = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = r;
+        vst4q_u8(dst + i * 4, v);
+    }
+    swap_rb_scalar(dst + i * 4, src + i * 4, n - i);
+}
+
+static void rgb888_neon(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x3_t v = vld3q_u8(src + i * 3);
+        uint8x16x4_t out = { { v.val[0], v.val[1], v.val[2], vdupq_n_u8(0xff) } };
+        vst4q_u8(dst + i * 4, out);
+    }
+    rgb888_scalar(dst + i * 4, src + i * 3, n - i);
+}
+
+static void rgb565_neon(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t v = vld1q_u16((const uint16_t*)(src + i * 2));
+        // each channel at the top of a byte, its top bits replicated below
+        uint8x8_t r = vand_u8(vshrn_n_u16(v, 8), vdup_n_u8(0xf8));
+        uint8x8_t g = vand_u8(vshrn_n_u16(v, 3), vdup_n_u8(0xfc));
+        uint8x8_t b = vand_u8(vmovn_u16(vshlq_n_u16(v, 3)), vdup_n_u8(0xf8));
+        uint8x8x4_t out;
+        out.val[0] = vorr_u8(r, vshr_n_u8(r, 5));
+        out.val[1] = vorr_u8(g, vshr_n_u8(g, 6));
+        out.val[2] = vorr_u8(b, vshr_n_u8(b, 5));
+        out.val[3] = vdup_n_u8(0xff);
+        vst4_u8(dst + i * 4, out);
+    }
+    rgb565_scalar(dst + i * 4, src + i * 2, n - i);
+}
+
+static uint16x4_t fp16_pixel(uint16x4_t h)
+{
+    float32x4_t v = vcvt_f32_f16(vreinterpret_f16_u16(h));
+    // maxnm returns the number for a NaN
+    v = vminq_f32(vmaxnmq_f32(v, vdupq_n_f32(0.0f)), vdupq_n_f32(1.0f));
+    return vmovn_u32(vcvtnq_u32_f32(vmulq_f32(v, vdupq_n_f32(255.0f))));
+}
+
+static void fp16_neon(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const uint16_t* s = (const uint16_t*)(src + i * 8);
+        uint16x8_t a = vld1q_u16(s);
+        uint16x8_t b = vld1q_u16(s + 8);
+        uint16x8_t lo = vcombine_u16(fp16_pixel(vget_low_u16(a)),
+                fp16_pixel(vget_high_u16(a)));
+        uint16x8_t hi = vcombine_u16(fp16_pixel(vget_low_u16(b)),
+                fp16_pixel(vget_high_u16(b)));
+        vst1q_u8(dst + i * 4, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+    }
+    fp16_scalar(dst + i * 4, src + i * 8, n - i);
+}
+
+static void pack565_neon(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint8x8x4_t v = vld4_u8(src + i * 4);
+        uint16x8_t r = vshll_n_u8(vand_u8(v.val[0], vdup_n_u8(0xf8)), 8);
+        uint16x8_t g = vshll_n_u8(vand_u8(v.val[1], vdup_n_u8(0xfc)), 3);
+        uint16x8_t b = vmovl_u8(vshr_n_u8(v.val[2], 3));
+        vst1q_u16((uint16_t*)(dst + i * 2), vorrq_u16(vorrq_u16(r, g), b));
+    }
+    pack565_scalar(dst + i * 2, src + i * 4, n - i);
+}
+
+#endif
+
+/*****************************************************************************/
+
+static pthread_once_t sConvertOnce = PTHREAD_ONCE_INIT;
+static convert_kernels_t sKernels = sScalarKernels;
+
+static void convert_init()
+{
+    char kernel[PROPERTY_VALUE_MAX];
+    property_get(CONVERT_KERNEL_PROP, kernel, "auto");
+    if (strcmp(kernel, "scalar")) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("ssse3")) {
+            sKernels.name = "ssse3";
+            sKernels.swapRb = swap_rb_ssse3;
+            sKernels.rgb888 = rgb888_ssse3;
+            sKernels.rgb565 = rgb565_sse2;
+            sKernels.pack565 = pack565_ssse3;
+            if (__builtin_cpu_supports("avx2")) {
+                sKernels.name = "avx2";
+                sKernels.swapRb = swap_rb_avx2;
+            }
+        }
+        if (__builtin_cpu_supports("f16c"))
+            sKernels.fp16 = fp16_f16c;
+#elif defined(__aarch64__)
+        sKernels.name = "neon";
+        sKernels.swapRb = swap_rb_neon;
+        sKernels.rgb888 = rgb888_neon;
+        sKernels.rgb565 = rgb565_neon;
+        sKernels.fp16 = fp16_neon;
+        sKernels.pack565 = pack565_neon;
+#endif
+    }
+    ALOGI("fb convert: %s kernels%s", sKernels.name,
+            sKernels.fp16 != fp16_scalar ? ", fp16 in simd" : "");
+}
+
+static row_fn_t decoder(const convert_kernels_t& k, int layout)
+{
+    switch (layout) {
+        case LAYOUT_BGRA8:  return k.swapRb;
+        case LAYOUT_RGB888: return k.rgb888;
+        case LAYOUT_RGB565: return k.rgb565;
+        case LAYOUT_FP16:   return k.fp16;
+        default:            return 0;
+    }
+}
+
+static row_fn_t encoder(const convert_kernels_t& k, int layout)
+{
+    switch (layout) {
+        case LAYOUT_BGRA8:  return k.swapRb;
+        case LAYOUT_RGB565: return k.pack565;
+        default:            return 0;
+    }
+}
+
+static void convert_row(const convert_kernels_t& k,
+        uint8_t* dst, int dstFormat, const uint8_t* src, int srcFormat,
+        size_t width)
+{
+    const row_fn_t decode = decoder(k, format_layout(srcFormat));
+    const row_fn_t encode = encoder(k, format_layout(dstFormat));
+    // RGBA on either side needs a single pass
+    if (!decode) {
+        encode(dst, src, width);
+        return;
+    }
+    if (!encode) {
+        decode(dst, src, width);
+        return;
+    }
+
+    const size_t srcBpp = formatBytesPerPixel(srcFormat);
+    const size_t dstBpp = formatBytesPerPixel(dstFormat);
+    uint8_t block[CONVERT_BLOCK * 4] __attribute__((aligned(64)));
+    for (size_t x = 0; x < width; x += CONVERT_BLOCK) {
+        const size_t n = width - x < CONVERT_BLOCK ? width - x : CONVERT_BLOCK;
+        decode(block, src + x * srcBpp, n);
+        encode(dst + x * dstBpp, block, n);
+    }
+}
+
+/*****************************************************************************/
+
+size_t formatBytesPerPixel(int format)
+{
+    switch (format_layout(format)) {
+        case LAYOUT_RGBA8:
+        case LAYOUT_BGRA8:  return 4;
+        case LAYOUT_RGB888: return 3;
+        case LAYOUT_RGB565: return 2;
+        case LAYOUT_FP16:   return 8;
+        default:            return 0;
+    }
+}
+
+bool formatsShareLayout(int format, int other)
+{
+    const int layout = format_layout(format);
+    return layout != LAYOUT_NONE && layout == format_layout(other);
+}
+
+bool convertSupported(int srcFormat, int dstFormat)
+{
+    const int src = format_layout(srcFormat);
+    const int dst = format_layout(dstFormat);
+    if (src == LAYOUT_NONE || src == dst)
+        return false;
+    return dst == LAYOUT_RGBA8 || dst == LAYOUT_BGRA8 || dst == LAYOUT_RGB565;
+}
+
+void convertRow(void* dst, int dstFormat, const void* src, int srcFormat,
+        size_t width)
+{
+    pthread_once(&sConvertOnce, convert_init);
+    convert_row(sKernels, (uint8_t*)dst, dstFormat,
+            (const uint8_t*)src, srcFormat, width);
+}
+
+void convertRowReference(void* dst, int dstFormat, const void* src,
+        int srcFormat, size_t width)
+{
+    convert_row(sScalarKernels, (uint8_t*)dst, dstFormat,
+            (const uint8_t*)src, srcFormat, width);
+}
@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*****************************************************************************/
+
+// Row copy used by fb_post. The framebuffer is only ever written by the CPU,
+// so the kernels below use non-temporal stores to keep the (large) frame out
+// of the caches, and big frames are split in bands across a few threads.
+// Conversions between pixel formats (convert.cpp) are split the same way.
+
+// "memcpy" forces the plain memcpy kernel
+#define COPY_KERNEL_PROP  "ro.boot.redroid_fb_copy"
+// number of threads (including the caller) copying a large frame
+#define COPY_THREADS_PROP "ro.boot.redroid_fb_copy_threads"
+
+#define MAX_COPY_THREADS 8
+// frames smaller than this are copied by the caller alone
+#define COPY_MT_THRESHOLD (2 << 20)
+
+typedef void (*copy_fn_t)(uint8_t* dst, const uint8_t* src, size_t len);
+
+static void copy_memcpy(uint8_t* dst, const uint8_t* src, size_t len)
+{
+    memcpy(dst, src, len);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+static void copy_sse2(uint8_t* dst, const uint8_t* src, size_t len)
+{
+    size_t head = (16 - (uintptr_t(dst) & 15)) & 15;
+    if (head > len)
+        head = len;
+    memcpy(dst, src, head);
+    dst += head; src += head; len -= head;
+
+    for (; len >= 64; dst += 64, src += 64, len -= 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + 0));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+        _mm_stream_si128((__m128i*)(dst + 0), a);
+        _mm_stream_si128((__m128i*)(dst + 16), b);
+        _mm_stream_si128((__m128i*)(dst + 32), c);
+        _mm_stream_si128((__m128i*)(dst + 48), d);
+    }
+    _mm_sfence();
+    memcpy(dst, src, len);
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(uint8_t* dst, const uint8_t* src, size_t len)
+{
+    size_t head = (32 - (uintptr_t(dst) & 31)) & 31;
+    if (head > len)
+        head = len;
+    memcpy(dst, src, head);
+    dst += head; src += head; len -= head;
+
+    for (; len >= 128; dst += 128, src += 128, len -= 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + 0));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+        _mm256_stream_si256((__m256i*)(dst + 0), a);
+        _mm256_stream_si256((__m256i*)(dst + 32), b);
+        _mm256_stream_si256((__m256i*)(dst + 64), c);
+        _mm256_stream_si256((__m256i*)(dst + 96), d);
+    }
+    _mm_sfence();
+    memcpy(dst, src, len);
+}
+
+#elif defined(__aarch64__)
+
+static void copy_neon(uint8_t* dst, const uint8_t* src, size_t len)
+{
+    size_t head = (16 - (uintptr_t(dst) & 15)) & 15;
+    if (head > len)
+        head = len;
+    memcpy(dst, src, head);
+    dst += head; src += head; len -= head;
+
+    for (; len >= 64; dst += 64, src += 64, len -= 64) {
+        uint8x16_t a = vld1q_u8(src + 0);
+        uint8x16_t b = vld1q_u8(src + 16);
+        uint8x16_t c = vld1q_u8(src + 32);
+        uint8x16_t d = vld1q_u8(src + 48);
+        // STNP: store pair with a non-temporal hint
+        __asm__ volatile("stnp %q0, %q1, [%2]\n"
+                         "stnp %q3, %q4, [%2, #32]\n"
+                         :: "w"(a), "w"(b), "r"(dst), "w"(c), "w"(d)
+                         : "memory");
+    }
+    memcpy(dst, src, len);
+}
+
+#endif
+
+/*****************************************************************************/
+
+struct copy_job_t {
+    uint8_t* dst;
+    const uint8_t* src;
+    size_t dstStride;
+    size_t srcStride;
+    size_t rowBytes;
+    size_t rows;
+    // converting 'width' pixels per row when not 0
+    size_t width;
+    int dstFormat;
+    int srcFormat;
+};
+
+static pthread_once_t sCopyOnce = PTHREAD_ONCE_INIT;
+static copy_fn_t sCopyFn = copy_memcpy;
+static int sCopyThreads = 1;
+
+// callers of copyRows() take turns on the worker threads
+static pthread_mutex_t sCopyLock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    copy_job_t job;
+    int bands;
+    int pending;
+    uint32_t generation;
+} sWorkers = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    {}, 0, 0, 0,
+};
+
+static void copy_band(const copy_job_t& job, int band, int bands)
+{
+    const size_t first = job.rows * band / bands;
+    const size_t last = job.rows * (band + 1) / bands;
+    uint8_t* dst = job.dst + first * job.dstStride;
+    const uint8_t* src = job.src + first * job.srcStride;
+
+    if (job.width) {
+        for (size_t y = first; y < last; y++) {
+            convertRow(dst, job.dstFormat, src, job.srcFormat, job.width);
+            dst += job.dstStride;
+            src += job.srcStride;
+        }
+        return;
+    }
+    if (job.dstStride == job.rowBytes && job.srcStride == job.rowBytes) {
+        sCopyFn(dst, src, (last - first) * job.rowBytes);
+        return;
+    }
+    for (size_t y = first; y < last; y++) {
+        sCopyFn(dst, src, job.rowBytes);
+        dst += job.dstStride;
+        src += job.srcStride;
+    }
+}
+
+static void* copy_worker(void* arg)
+{
+    const int band = int(intptr_t(arg));
+    uint32_t seen = 0;
+
+    pthread_mutex_lock(&sWorkers.lock);
+    for (;;) {
+        while (sWorkers.generation == seen || band >= sWorkers.bands)  {
+            seen = sWorkers.generation;
+            pthread_cond_wait(&sWorkers.start, &sWorkers.lock);
+        }
+        seen = sWorkers.generation;
+        copy_job_t job = sWorkers.job;
+        int bands = sWorkers.bands;
+        pthread_mutex_unlock(&sWorkers.lock);
+
+        copy_band(job, band, bands);
+
+        pthread_mutex_lock(&sWorkers.lock);
+        if (--sWorkers.pending == 0)
+            pthread_cond_signal(&sWorkers.done);
+    }
+    return 0;
+}
+
+static void copy_init()
+{
+    const char* name = "memcpy";
+    char kernel[PROPERTY_VALUE_MAX];
+    property_get(COPY_KERNEL_PROP, kernel, "auto");
+    if (strcmp(kernel, "memcpy")) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            sCopyFn = copy_avx2;
+            name = "avx2";
+        } else if (__builtin_cpu_supports("sse2")) {
+            sCopyFn = copy_sse2;
+            name = "sse2";
+        }
+#elif defined(__aarch64__)
+        sCopyFn = copy_neon;
+        name = "neon";
+#endif
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = property_get_int32(COPY_THREADS_PROP, cpus < 4 ? cpus : 4);
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_COPY_THREADS)
+        threads = MAX_COPY_THREADS;
+
+    sCopyThreads = 1;
+    for (int i = 1; i < threads; i++) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int err = pthread_create(&thread, &attr, copy_worker, (void*)intptr_t(i));
+        pthread_attr_destroy(&attr);
+        if (err) {
+            ALOGW("couldn't start copy thread (%s)", strerror(err));
+            break;
+        }
+        pthread_setname_np(thread, "gralloc-copy");
+        sCopyThreads++;
+    }
+
+    ALOGI("fb copy: %s kernel, %d thread(s)", name, sCopyThreads);
+}
+
+// runs a job on the caller and the worker threads, large enough ones
+static void run_job(const copy_job_t& job, size_t bytes)
+{
+    pthread_once(&sCopyOnce, copy_init);
+
+    int bands = sCopyThreads;
+    if (bytes < COPY_MT_THRESHOLD)
+        bands = 1;
+    if (size_t(bands) > job.rows)
+        bands = job.rows;
+    if (bands <= 1) {
+        copy_band(job, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&sCopyLock);
+    pthread_mutex_lock(&sWorkers.lock);
+    sWorkers.job = job;
+    sWorkers.bands = bands;
+    sWorkers.pending = bands - 1;
+    sWorkers.generation++;
+    pthread_cond_broadcast(&sWorkers.start);
+    pthread_mutex_unlock(&sWorkers.lock);
+
+    copy_band(job, 0, bands);
+
+    pthread_mutex_lock(&sWorkers.lock);
+    while (sWorkers.pending)
+        pthread_cond_wait(&sWorkers.done, &sWorkers.lock);
+    pthread_mutex_unlock(&sWorkers.lock);
+    pthread_mutex_unlock(&sCopyLock);
+}
+
+void copyRows(void* dst, size_t dstStride,
+        const void* src, size_t srcStride,
+        size_t rowBytes, size_t rows)
+{
+    copy_job_t job = { (uint8_t*)dst, (const uint8_t*)src,
+            dstStride, srcStride, rowBytes, rows, 0, 0, 0 };
+    run_job(job, rowBytes * rows);
+}
+
+void convertRows(void* dst, size_t dstStride, int dstFormat,
+        const void* src, size_t srcStride, int srcFormat,
+        size_t width, size_t rows)
+{
+    copy_job_t job = { (uint8_t*)dst, (const uint8_t*)src,
+            dstStride, srcStride, 0, rows, width, dstFormat, srcFormat };
+    run_job(job, width * formatBytesPerPixel(dstFormat) * rows);
+}
@@ -0,0 +1,397 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/fs.h>
+#include <linux/userfaultfd.h>
+
+#include <vector>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*****************************************************************************/
+
+// Finds the pages of a posted buffer that may differ from the front buffer:
+// the ones written since the buffer was last posted, plus the ones other
+// posts changed in the meantime. fb_post compares those rows with the front
+// buffer and copies the ones that really differ; comparing is what keeps a
+// full copy of one buffer from forcing full copies of all the others.
+//
+// The kernel only sees writes made through this process' own mapping of the
+// buffer: this is meant for instances where composition happens on the CPU
+// inside the process calling fb_post, and needs the memfd backend so that
+// the renderer and fb_post share a mapping. GPU, device and other process'
+// writes go unseen, so it is never turned on implicitly, and fb_post only
+// hands it buffers that nothing else writes.
+//
+//  uffd       userfaultfd async write-protect + PAGEMAP_SCAN (Linux 6.7+),
+//             scoped to the tracked buffers
+//
+// PAGEMAP_SCAN collects the written pages and write-protects them again in
+// one step. Soft-dirty bits can't be read and cleared atomically, a write
+// between the two would be lost and leave stale content on screen, so
+// kernels without it copy full frames.
+#define DAMAGE_PROP "ro.boot.redroid_fb_damage"
+
+// above this share of written pages the buffer is copied without comparing
+#define DAMAGE_FULL_PERCENT 75
+#define MAX_TRACKED_BUFFERS 8
+
+#ifndef PAGEMAP_SCAN
+#define PAGE_IS_WRITTEN         (1 << 1)
+#define PM_SCAN_WP_MATCHING     (1 << 0)
+#define PM_SCAN_CHECK_WPASYNC   (1 << 1)
+struct page_region {
+    __u64 start;
+    __u64 end;
+    __u64 categories;
+};
+struct pm_scan_arg {
+    __u64 size;
+    __u64 flags;
+    __u64 start;
+    __u64 end;
+    __u64 walk_end;
+    __u64 vec;
+    __u64 vec_len;
+    __u64 max_pages;
+    __u64 category_inverted;
+    __u64 category_mask;
+    __u64 category_anyof_mask;
+    __u64 return_mask;
+};
+#define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+#endif
+
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY 1
+#endif
+#ifndef UFFD_FEATURE_WP_HUGETLBFS_SHMEM
+#define UFFD_FEATURE_WP_HUGETLBFS_SHMEM (1 << 12)
+#endif
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+#define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+#endif
+#ifndef UFFD_FEATURE_WP_ASYNC
+#define UFFD_FEATURE_WP_ASYNC (1 << 15)
+#endif
+
+enum {
+    DAMAGE_OFF = 0,
+    DAMAGE_UFFD,
+};
+
+struct tracked_buffer_t {
+    dev_t dev;
+    ino_t ino;
+    uintptr_t vaddr;
+    size_t size;
+    uint64_t lastPost;
+    // pages of the front buffer that may differ from this buffer
+    std::vector<uint64_t> stale;
+};
+
+// one per front buffer, owned by its fb device
+struct damage_tracker_t {
+    std::vector<tracked_buffer_t> buffers;
+    uint64_t posts;
+    // buffer of the last damageCollect(), -1 if it wasn't tracked
+    int current;
+};
+
+static pthread_once_t sDamageOnce = PTHREAD_ONCE_INIT;
+static int sDamageMode = DAMAGE_OFF;
+static int sPagemapFd = -1;
+static int sUffd = -1;
+
+static bool uffd_init()
+{
+    sUffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+    if (sUffd < 0)
+        return false;
+
+    struct uffdio_api api;
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED |
+            UFFD_FEATURE_WP_HUGETLBFS_SHMEM;
+    if (ioctl(sUffd, UFFDIO_API, &api) < 0) {
+        close(sUffd);
+        sUffd = -1;
+        return false;
+    }
+    return true;
+}
+
+static void damage_init()
+{
+    char mode[PROPERTY_VALUE_MAX];
+    property_get(DAMAGE_PROP, mode, "off");
+    if (!strcmp(mode, "off"))
+        return;
+
+    sPagemapFd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (sPagemapFd < 0) {
+        ALOGW("damage tracking disabled, no pagemap (%s)", strerror(errno));
+        return;
+    }
+
+    if (!strcmp(mode, "uffd") && uffd_init()) {
+        sDamageMode = DAMAGE_UFFD;
+    } else {
+        ALOGW("damage tracking '%s' not supported by this kernel", mode);
+        close(sPagemapFd);
+        sPagemapFd = -1;
+        return;
+    }
+    ALOGI("damage tracking: uffd");
+}
+
+static inline void set_bit(std::vector<uint64_t>& bits, size_t i)
+{
+    bits[i / 64] |= 1ULL << (i % 64);
+}
+
+static bool uffd_protect(uintptr_t vaddr, size_t size)
+{
+    struct uffdio_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.range.start = vaddr;
+    reg.range.len = size;
+    reg.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(sUffd, UFFDIO_REGISTER, &reg) < 0)
+        return false;
+
+    struct uffdio_writeprotect wp;
+    memset(&wp, 0, sizeof(wp));
+    wp.range.start = vaddr;
+    wp.range.len = size;
+    wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+    return ioctl(sUffd, UFFDIO_WRITEPROTECT, &wp) == 0;
+}
+
+static void uffd_unprotect(uintptr_t vaddr, size_t size)
+{
+    struct uffdio_range range;
+    range.start = vaddr;
+    range.len = size;
+    ioctl(sUffd, UFFDIO_UNREGISTER, &range);
+}
+
+// collects the pages written since the previous scan and write-protects
+// them again
+static bool uffd_scan(const tracked_buffer_t& b, std::vector<uint64_t>& written)
+{
+    struct page_region regions[64];
+    uintptr_t start = b.vaddr;
+    const uintptr_t end = b.vaddr + b.size;
+    while (start < end) {
+        struct pm_scan_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.size = sizeof(arg);
+        arg.flags = PM_SCAN_WP_MATCHING | PM_SCAN_CHECK_WPASYNC;
+        arg.start = start;
+        arg.end = end;
+        arg.vec = uintptr_t(regions);
+        arg.vec_len = 64;
+        arg.category_mask = PAGE_IS_WRITTEN;
+        arg.return_mask = PAGE_IS_WRITTEN;
+        int n = ioctl(sPagemapFd, PAGEMAP_SCAN, &arg);
+        if (n < 0)
+            return false;
+        for (int i = 0; i < n; i++) {
+            for (uintptr_t p = regions[i].start; p < regions[i].end; p += PAGE_SIZE)
+                set_bit(written, (p - b.vaddr) / PAGE_SIZE);
+        }
+        if (arg.walk_end <= start)
+            return false;
+        start = arg.walk_end;
+    }
+    return true;
+}
+
+static int track_buffer(damage_tracker_t* t, const struct stat& st,
+        uintptr_t vaddr, size_t size)
+{
+    std::vector<tracked_buffer_t>& buffers = t->buffers;
+    for (size_t i = 0; i < buffers.size(); i++) {
+        const tracked_buffer_t& b = buffers[i];
+        if (b.dev == st.st_dev && b.ino == st.st_ino &&
+                b.vaddr == vaddr && b.size == size)
+            return i;
+    }
+
+    // forget buffers unmapped since, their address range was reused
+    for (size_t i = 0; i < buffers.size(); ) {
+        const tracked_buffer_t& b = buffers[i];
+        if (b.vaddr < vaddr + size && vaddr < b.vaddr + b.size)
+            buffers.erase(buffers.begin() + i);
+        else
+            i++;
+    }
+
+    if (!uffd_protect(vaddr, size)) {
+        ALOGW("couldn't write-protect %#zx (%s)", size_t(vaddr), strerror(errno));
+        return -1;
+    }
+
+    if (buffers.size() >= MAX_TRACKED_BUFFERS) {
+        size_t lru = 0;
+        for (size_t i = 1; i < buffers.size(); i++) {
+            if (buffers[i].lastPost < buffers[lru].lastPost)
+                lru = i;
+        }
+        uffd_unprotect(buffers[lru].vaddr, buffers[lru].size);
+        buffers.erase(buffers.begin() + lru);
+    }
+
+    tracked_buffer_t b;
+    b.dev = st.st_dev;
+    b.ino = st.st_ino;
+    b.vaddr = vaddr;
+    b.size = size;
+    b.lastPost = 0;
+    const size_t words = (size / PAGE_SIZE + 63) / 64;
+    // the front buffer holds nothing of a buffer we never saw
+    b.stale.assign(words, ~0ULL);
+    buffers.push_back(b);
+    return buffers.size() - 1;
+}
+
+// the front buffer was overwritten by something we can't account for
+static void invalidate_all(damage_tracker_t* t)
+{
+    for (size_t i = 0; i < t->buffers.size(); i++) {
+        std::vector<uint64_t>& stale = t->buffers[i].stale;
+        stale.assign(stale.size(), ~0ULL);
+    }
+    t->current = -1;
+}
+
+/*****************************************************************************/
+
+damage_tracker_t* damageOpen()
+{
+    pthread_once(&sDamageOnce, damage_init);
+    if (sDamageMode == DAMAGE_OFF)
+        return 0;
+
+    damage_tracker_t* t = new damage_tracker_t();
+    t->posts = 0;
+    t->current = -1;
+    return t;
+}
+
+void damageClose(damage_tracker_t* t)
+{
+    if (!t)
+        return;
+    for (size_t i = 0; i < t->buffers.size(); i++)
+        uffd_unprotect(t->buffers[i].vaddr, t->buffers[i].size);
+    delete t;
+}
+
+int damageCollect(damage_tracker_t* t, int fd, const void* vaddr, size_t size,
+        std::vector<uint64_t>* pages)
+{
+    if (!t)
+        return -1;
+
+    // ashmem regions can't be told apart, see mapper.cpp
+    struct stat st;
+    int index = -1;
+    if (!(uintptr_t(vaddr) & (PAGE_SIZE-1)) &&
+            fstat(fd, &st) == 0 && !S_ISCHR(st.st_mode)) {
+        index = track_buffer(t, st, uintptr_t(vaddr), size);
+    }
+    if (index < 0) {
+        invalidate_all(t);
+        return -1;
+    }
+
+    tracked_buffer_t& b = t->buffers[index];
+    b.lastPost = ++t->posts;
+    t->current = index;
+
+    const size_t count = size / PAGE_SIZE;
+    const size_t words = (count + 63) / 64;
+    std::vector<uint64_t> written(words, 0);
+    const bool ok = uffd_scan(b, written);
+
+    size_t numWritten = 0;
+    for (size_t i = 0; i < words; i++)
+        numWritten += __builtin_popcountll(written[i]);
+
+    if (!ok || numWritten > count * DAMAGE_FULL_PERCENT / 100) {
+        ALOGW_IF(!ok, "damage tracking failed (%s)", strerror(errno));
+        // this buffer was mostly redrawn, comparing isn't worth it
+        invalidate_all(t);
+        b.stale.assign(words, 0);
+        return -1;
+    }
+
+    pages->resize(words);
+    int candidates = 0;
+    for (size_t i = 0; i < words; i++) {
+        (*pages)[i] = written[i] | b.stale[i];
+        if (i == words - 1 && (count % 64))
+            (*pages)[i] &= (1ULL << (count % 64)) - 1;
+        candidates += __builtin_popcountll((*pages)[i]);
+    }
+    return candidates;
+}
+
+void damageInvalidate(damage_tracker_t* t)
+{
+    if (t)
+        invalidate_all(t);
+}
+
+void damageCommit(damage_tracker_t* t, const std::vector<uint64_t>& changed)
+{
+    if (!t || t->current < 0)
+        return;
+
+    // the front buffer now matches the posted buffer, and differs from the
+    // others wherever it changed
+    tracked_buffer_t& b = t->buffers[t->current];
+    b.stale.assign(b.stale.size(), 0);
+    for (size_t i = 0; i < t->buffers.size(); i++) {
+        tracked_buffer_t& other = t->buffers[i];
+        if (&other == &b)
+            continue;
+        if (other.size != b.size || changed.size() != other.stale.size()) {
+            other.stale.assign(other.stale.size(), ~0ULL);
+            continue;
+        }
+        for (size_t w = 0; w < changed.size(); w++)
+            other.stale[w] |= changed[w];
+    }
+    t->current = -1;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+#include <linux/magic.h>
+#include <linux/memfd.h>
+#include <linux/udmabuf.h>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+
+#include <hardware/gralloc.h>
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*****************************************************************************/
+
+// Buffers can be allocated as dma-bufs, which codec2 and the other dma-buf
+// importers take without a copy. They come from a dma-buf heap, or, on
+// kernels without one, from udmabuf wrapping a memfd. Without either,
+// allocRegion() (ashmem or memfd) is used as before.
+
+// true allocates buffers as dma-bufs
+#define DMABUF_PROP "ro.boot.redroid_gralloc_dmabuf"
+// name of the heap under /dev/dma_heap
+#define DMA_HEAP_PROP "ro.boot.redroid_gralloc_dma_heap"
+
+#define UDMABUF_DEV "/dev/udmabuf"
+
+enum {
+    DMABUF_NONE = 0,
+    DMABUF_HEAP,
+    DMABUF_UDMABUF,
+};
+
+static pthread_once_t sDmaBufOnce = PTHREAD_ONCE_INIT;
+static int sDmaBufBackend = DMABUF_NONE;
+static int sDmaBufDev = -1;
+
+static void dmabuf_init()
+{
+    if (!property_get_bool(DMABUF_PROP, false))
+        return;
+
+    char heap[PROPERTY_VALUE_MAX];
+    char path[PROPERTY_VALUE_MAX + 16];
+    property_get(DMA_HEAP_PROP, heap, "system");
+    snprintf(path, sizeof(path), "/dev/dma_heap/%s", heap);
+    sDmaBufDev = open(path, O_RDONLY | O_CLOEXEC);
+    if (sDmaBufDev >= 0) {
+        sDmaBufBackend = DMABUF_HEAP;
+        ALOGI("allocating buffers from dma-buf heap %s", heap);
+        return;
+    }
+    ALOGW("no dma-buf heap %s (%s), trying udmabuf", heap, strerror(errno));
+
+    sDmaBufDev = open(UDMABUF_DEV, O_RDWR | O_CLOEXEC);
+    if (sDmaBufDev >= 0) {
+        sDmaBufBackend = DMABUF_UDMABUF;
+        ALOGI("allocating buffers from udmabuf");
+        return;
+    }
+    ALOGW("no udmabuf either (%s), buffers won't be dma-bufs", strerror(errno));
+}
+
+static int alloc_heap(size_t size)
+{
+    struct dma_heap_allocation_data data;
+    memset(&data, 0, sizeof(data));
+    data.len = size;
+    data.fd_flags = O_RDWR | O_CLOEXEC;
+    if (ioctl(sDmaBufDev, DMA_HEAP_IOCTL_ALLOC, &data) < 0)
+        return -errno;
+    return data.fd;
+}
+
+static int alloc_udmabuf(const char* name, size_t size)
+{
+    // udmabuf pins the pages of a memfd that can't shrink under it
+    int memfd = syscall(__NR_memfd_create, name,
+            MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0)
+        return -errno;
+    if (ftruncate(memfd, size) < 0 ||
+            fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+        int err = -errno;
+        close(memfd);
+        return err;
+    }
+
+    struct udmabuf_create create;
+    memset(&create, 0, sizeof(create));
+    create.memfd = memfd;
+    create.flags = UDMABUF_FLAGS_CLOEXEC;
+    create.offset = 0;
+    create.size = size;
+    int fd = ioctl(sDmaBufDev, UDMABUF_CREATE, &create);
+    int err = -errno;
+    // the dma-buf keeps the pages
+    close(memfd);
+    return fd < 0 ? err : fd;
+}
+
+/*****************************************************************************/
+
+int allocDmaBuf(const char* name, size_t size)
+{
+    pthread_once(&sDmaBufOnce, dmabuf_init);
+
+    int fd;
+    switch (sDmaBufBackend) {
+        case DMABUF_HEAP:
+            fd = alloc_heap(size);
+            break;
+        case DMABUF_UDMABUF:
+            fd = alloc_udmabuf(name, size);
+            break;
+        default:
+            return -ENODEV;
+    }
+    if (fd < 0) {
+        ALOGE("couldn't allocate a dma-buf (%s)", strerror(-fd));
+        return fd;
+    }
+    // shows up in /sys/kernel/debug/dma_buf/bufinfo, not all kernels have it
+    ioctl(fd, DMA_BUF_SET_NAME, name);
+    return fd;
+}
+
+bool dmaBufEnabled()
+{
+    pthread_once(&sDmaBufOnce, dmabuf_init);
+    return sDmaBufBackend != DMABUF_NONE;
+}
+
+bool isDmaBuf(int fd)
+{
+    struct statfs st;
+    return fstatfs(fd, &st) == 0 && st.f_type == DMA_BUF_MAGIC;
+}
+
+int syncDmaBuf(int fd, int usage, bool start)
+{
+    struct dma_buf_sync sync;
+    sync.flags = start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END;
+    if (usage & GRALLOC_USAGE_SW_READ_MASK)
+        sync.flags |= DMA_BUF_SYNC_READ;
+    if (usage & GRALLOC_USAGE_SW_WRITE_MASK)
+        sync.flags |= DMA_BUF_SYNC_WRITE;
+    if (!(sync.flags & DMA_BUF_SYNC_RW))
+        sync.flags |= DMA_BUF_SYNC_RW;
+
+    int err;
+    do {
+        err = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+    } while (err < 0 && (errno == EINTR || errno == EAGAIN));
+    if (err < 0) {
+        ALOGE("dma-buf sync failed (%s)", strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
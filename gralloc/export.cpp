@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*****************************************************************************/
+
+// Every posted frame is copied into a ring shared with the consumers that
+// connected to a unix socket (the streaming and recording sidecars). The
+// layout and the reader side of the protocol are in gralloc_priv.h. Nothing
+// is copied while no consumer wants frames.
+//
+// Consumers can only map the ring read-only, and the producer never reads
+// anything back from shared memory but the 'waiters' count of the control
+// page: the ring geometry it copies with is its own.
+//
+// Whoever can connect sees the screen, without the consent MediaProjection
+// would ask for: exporting is off unless a path is set, and the socket is
+// only open to its owner and group.
+
+// path of the socket, e.g. /ipc/gralloc_fb; "off" (default) disables
+// exporting. Displays other than fb0 get a .<index> suffix.
+#define EXPORT_PATH_PROP  "ro.boot.redroid_fb_export"
+// group of the socket, the one of the sidecars
+#define EXPORT_GROUP_PROP "ro.boot.redroid_fb_export_group"
+// number of frames in the ring
+#define EXPORT_SLOTS_PROP "ro.boot.redroid_fb_export_slots"
+
+#define MAX_CONSUMERS 8
+
+struct fb_exporter_t {
+    int ringFd;
+    size_t ringSize;
+    fb_export_header_t* header;
+    int controlFd;
+    fb_export_control_t* control;
+    uint64_t frame;
+
+    // geometry of the ring, as published in the header
+    size_t stride;
+    size_t height;
+    int format;
+    uint32_t slots;
+    size_t slotSize;
+    size_t dataOffset;
+
+    int listenFd;
+    char path[PROPERTY_VALUE_MAX + 16];
+    int wakeFd;             // eventfd asking the socket thread to exit
+    pthread_t thread;
+    int consumers;          // connected consumers, atomic
+};
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static int send_ring(int sock, const fb_exporter_t* exporter)
+{
+    const int fds[2] = { exporter->ringFd, exporter->controlFd };
+    uint64_t sizes[2] = { exporter->ringSize, PAGE_SIZE };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { sizes, sizeof(sizes) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t len;
+    do {
+        len = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (len < 0 && errno == EINTR);
+    return len == sizeof(sizes) ? 0 : -1;
+}
+
+// accepts consumers, hands them the ring and keeps their socket around to
+// notice when they go away
+static void* export_thread(void* arg)
+{
+    fb_exporter_t* exporter = (fb_exporter_t*)arg;
+    struct pollfd fds[2 + MAX_CONSUMERS];
+    int count = 2;
+    fds[0].fd = exporter->wakeFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = exporter->listenFd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            ALOGE("frame export poll failed (%s)", strerror(errno));
+            break;
+        }
+        if (fds[0].revents)
+            break;
+
+        for (int i = 2; i < count; ) {
+            if (fds[i].revents) {
+                // consumers never talk to us, anything means they're gone
+                close(fds[i].fd);
+                fds[i] = fds[--count];
+                __atomic_fetch_sub(&exporter->consumers, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            i++;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int sock = accept4(exporter->listenFd, 0, 0, SOCK_CLOEXEC);
+            if (sock < 0)
+                continue;
+            if (count == 2 + MAX_CONSUMERS ||
+                    send_ring(sock, exporter) < 0) {
+                ALOGW("dropping frame export consumer");
+                close(sock);
+                continue;
+            }
+            fds[count].fd = sock;
+            fds[count].events = POLLIN;
+            fds[count].revents = 0;
+            count++;
+            __atomic_fetch_add(&exporter->consumers, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    for (int i = 2; i < count; i++)
+        close(fds[i].fd);
+    return 0;
+}
+
+static int export_listen(const char* path)
+{
+    char group[PROPERTY_VALUE_MAX];
+    property_get(EXPORT_GROUP_PROP, group, "graphics");
+    struct group* gr = getgrnam(group);
+    if (!gr) {
+        ALOGW("no group '%s', frame export limited to uid %d", group, getuid());
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(addr.sun_path, path, strlen(path));
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            chmod(path, 0660) < 0 ||
+            (gr && chown(path, -1, gr->gr_gid) < 0) ||
+            listen(fd, MAX_CONSUMERS) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*****************************************************************************/
+
+fb_exporter_t* exportOpen(uint32_t display, uint32_t width, uint32_t height,
+        uint32_t bpp, int format)
+{
+    char path[PROPERTY_VALUE_MAX + 16];
+    property_get(EXPORT_PATH_PROP, path, "off");
+    if (!strcmp(path, "off") || !path[0])
+        return 0;
+    if (display > 0) {
+        const size_t len = strlen(path);
+        snprintf(path + len, sizeof(path) - len, ".%u", display);
+    }
+
+    int32_t slots = property_get_int32(EXPORT_SLOTS_PROP, 3);
+    if (slots < 2)
+        slots = 2;
+    if (slots > FB_EXPORT_MAX_SLOTS)
+        slots = FB_EXPORT_MAX_SLOTS;
+
+    const size_t stride = width * bpp;
+    const size_t dataOffset = roundUpToPageSize(sizeof(fb_export_header_t));
+    const size_t slotSize = roundUpToPageSize(stride * height);
+    const size_t ringSize = dataOffset + slotSize * slots;
+
+    fb_exporter_t* exporter = (fb_exporter_t*)calloc(1, sizeof(*exporter));
+    exporter->ringFd = -1;
+    exporter->controlFd = -1;
+    exporter->listenFd = -1;
+    exporter->wakeFd = -1;
+
+    exporter->ringFd = allocRegion(ringSize);
+    if (exporter->ringFd < 0)
+        goto fail;
+    exporter->ringSize = ringSize;
+    exporter->header = (fb_export_header_t*)mmap(0, ringSize,
+            PROT_READ|PROT_WRITE, MAP_SHARED, exporter->ringFd, 0);
+    if (exporter->header == MAP_FAILED) {
+        exporter->header = 0;
+        goto fail;
+    }
+
+    exporter->stride = stride;
+    exporter->height = height;
+    exporter->format = format;
+    exporter->slots = slots;
+    exporter->slotSize = slotSize;
+    exporter->dataOffset = dataOffset;
+    exporter->header->magic = FB_EXPORT_MAGIC;
+    exporter->header->version = FB_EXPORT_VERSION;
+    exporter->header->width = width;
+    exporter->header->height = height;
+    exporter->header->stride = stride;
+    exporter->header->format = format;
+    exporter->header->slots = slots;
+    exporter->header->slotSize = slotSize;
+    exporter->header->dataOffset = dataOffset;
+    // our own mapping stays writable, the ones of the consumers can't be
+    if (protectRegion(exporter->ringFd) < 0)
+        goto fail;
+
+    exporter->controlFd = allocRegion(PAGE_SIZE);
+    if (exporter->controlFd < 0)
+        goto fail;
+    exporter->control = (fb_export_control_t*)mmap(0, PAGE_SIZE,
+            PROT_READ|PROT_WRITE, MAP_SHARED, exporter->controlFd, 0);
+    if (exporter->control == MAP_FAILED) {
+        exporter->control = 0;
+        goto fail;
+    }
+
+    exporter->listenFd = export_listen(path);
+    if (exporter->listenFd < 0)
+        goto fail;
+    strcpy(exporter->path, path);
+    exporter->wakeFd = eventfd(0, EFD_CLOEXEC);
+    if (exporter->wakeFd < 0)
+        goto fail;
+    if (pthread_create(&exporter->thread, 0, export_thread, exporter)) {
+        errno = EAGAIN;
+        goto fail;
+    }
+    pthread_setname_np(exporter->thread, "gralloc-export");
+
+    ALOGI("exporting frames on %s, %d slots of %zu KiB",
+            path, slots, slotSize >> 10);
+    return exporter;
+
+fail:
+    ALOGW("frame export disabled (%s)", strerror(errno));
+    if (exporter->wakeFd >= 0)
+        close(exporter->wakeFd);
+    if (exporter->listenFd >= 0) {
+        close(exporter->listenFd);
+        unlink(path);
+    }
+    if (exporter->control)
+        munmap(exporter->control, PAGE_SIZE);
+    if (exporter->controlFd >= 0)
+        close(exporter->controlFd);
+    if (exporter->header)
+        munmap(exporter->header, ringSize);
+    if (exporter->ringFd >= 0)
+        close(exporter->ringFd);
+    free(exporter);
+    return 0;
+}
+
+void exportClose(fb_exporter_t* exporter)
+{
+    if (!exporter)
+        return;
+
+    uint64_t one = 1;
+    write(exporter->wakeFd, &one, sizeof(one));
+    pthread_join(exporter->thread, 0);
+
+    close(exporter->wakeFd);
+    close(exporter->listenFd);
+    unlink(exporter->path);
+    munmap(exporter->control, PAGE_SIZE);
+    close(exporter->controlFd);
+    munmap(exporter->header, exporter->ringSize);
+    close(exporter->ringFd);
+    free(exporter);
+}
+
+void exportFrame(fb_exporter_t* exporter, const void* src, size_t srcStride,
+        int format)
+{
+    // a second full copy of the frame, only made for consumers waiting on
+    // it; whatever they wrote in 'waiters' only decides that
+    if (!exporter || !__atomic_load_n(&exporter->consumers, __ATOMIC_RELAXED) ||
+            !__atomic_load_n(&exporter->control->waiters, __ATOMIC_SEQ_CST))
+        return;
+    if (srcStride < exporter->stride ||
+            !formatsShareLayout(format, exporter->format))
+        return;
+
+    fb_export_header_t* header = exporter->header;
+    const uint64_t frame = ++exporter->frame;
+    const uint32_t index = frame % exporter->slots;
+    fb_export_slot_t* slot = &header->slot[index];
+    uint8_t* dst = (uint8_t*)header + exporter->dataOffset +
+            index * exporter->slotSize;
+
+    // seqlock: readers retry or skip a slot while its seq is odd
+    const uint32_t seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    copyRows(dst, exporter->stride, src, srcStride, exporter->stride,
+            exporter->height);
+    slot->frame = frame;
+    slot->timestamp = now_ns();
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->latest, uint32_t(frame), __ATOMIC_SEQ_CST);
+    syscall(__NR_futex, &header->latest, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+}
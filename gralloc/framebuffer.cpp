@@ -17,13 +17,18 @@
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <cutils/ashmem.h>
 #include <cutils/atomic.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 
 #include <hardware/gralloc.h>
@@ -45,17 +50,47 @@
 #define USE_PAN_DISPLAY 0
 #endif
 
-// numbers of buffers for page flipping
+// numbers of buffers for page flipping, unless overridden at runtime
 #define NUM_BUFFERS 2
+#define NUM_BUFFERS_PROP "ro.boot.redroid_fb_buffers"
+// one bit per buffer in private_module_t::bufferMask
+#define MAX_BUFFERS 32
+
+// refresh rate override, also used to pace fb_post
+#define FPS_PROP "ro.boot.redroid_fps"
+// geometry of the virtual framebuffer used when there is no fbdev
+#define WIDTH_PROP  "ro.boot.redroid_width"
+#define HEIGHT_PROP "ro.boot.redroid_height"
+#define DPI_PROP    "ro.boot.redroid_dpi"
+// number of virtual framebuffers, secondary ones read the geometry above
+// with a _<index> suffix (ro.boot.redroid_width_1), or use the primary's
+#define DISPLAYS_PROP "ro.boot.redroid_displays"
+#define MAX_SWAP_INTERVAL 4
 
 
 enum {
     PAGE_FLIP = 0x00000001,
-    LOCKED = 0x00000002
+    LOCKED = 0x00000002,
+    // memfd-backed framebuffer, flipping just moves yoffset
+    VIRTUAL = 0x00000004
 };
 
 struct fb_context_t {
     framebuffer_device_t  device;
+    private_display_t* display;
+    // area set by setUpdateRect(), only valid for the next post
+    bool hasUpdateRect;
+    struct {
+        int l, t, r, b;
+    } updateRect;
+    // damage tracking of the buffers posted through the copy path
+    damage_tracker_t* damage;
+    // timerfd ticking at the refresh rate, fb_post waits for swapInterval
+    // ticks since the previous post
+    int vsyncFd;
+    int swapInterval;
+    // copy of the posted frames for local consumers
+    fb_exporter_t* exporter;
 };
 
 /*****************************************************************************/
@@ -65,51 +100,301 @@ static int fb_setSwapInterval(struct framebuffer_device_t* dev,
 {
     if (interval < dev->minSwapInterval || interval > dev->maxSwapInterval)
         return -EINVAL;
-    // FIXME: implement fb_setSwapInterval
+    fb_context_t* ctx = (fb_context_t*)dev;
+    ctx->swapInterval = interval;
     return 0;
 }
 
+// blocks until swapInterval vsync ticks have elapsed since the previous
+// post, or not at all with an interval of 0
+static void fb_wait_vsync(fb_context_t* ctx)
+{
+    if (ctx->vsyncFd < 0 || ctx->swapInterval <= 0)
+        return;
+
+    GRALLOC_TRACE_SECTION("fb_wait_vsync interval=%d", ctx->swapInterval);
+    uint64_t ticks = 0;
+    while (ticks < uint64_t(ctx->swapInterval)) {
+        uint64_t expirations;
+        ssize_t len = read(ctx->vsyncFd, &expirations, sizeof(expirations));
+        if (len == sizeof(expirations)) {
+            ticks += expirations;
+        } else if (len < 0 && errno != EINTR) {
+            ALOGE("vsync timer failed (%s)", strerror(errno));
+            return;
+        }
+    }
+}
+
+static int fb_open_vsync(float fps)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (fd < 0) {
+        ALOGE("couldn't create vsync timer (%s)", strerror(errno));
+        return -1;
+    }
+
+    const long period = long(1000000000.0f / fps);
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = period / 1000000000;
+    spec.it_interval.tv_nsec = period % 1000000000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(fd, 0, &spec, 0) < 0) {
+        ALOGE("couldn't start vsync timer (%s)", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int fb_setUpdateRect(struct framebuffer_device_t* dev,
+        int l, int t, int w, int h)
+{
+    if (((w|h) <= 0) || ((l|t)<0))
+        return -EINVAL;
+
+    fb_context_t* ctx = (fb_context_t*)dev;
+    ctx->updateRect.l = l;
+    ctx->updateRect.t = t;
+    ctx->updateRect.r = l + w;
+    ctx->updateRect.b = t + h;
+    ctx->hasUpdateRect = true;
+    return 0;
+}
+
+// copies the rows of the candidate pages that differ from the front buffer,
+// and records the source pages of the rows that changed. Returns the number
+// of rows copied.
+static size_t copy_damage(uint8_t* dst, size_t dstStride,
+        const uint8_t* src, size_t srcStride,
+        size_t rowBytes, size_t rows,
+        const std::vector<uint64_t>& pages,
+        std::vector<uint64_t>* changed)
+{
+    changed->assign(pages.size(), 0);
+    size_t copied = 0;
+    size_t first = 0, last = 0;     // pending run of changed rows
+    size_t next = 0;                // rows before this one were compared
+    for (size_t p = 0; p < pages.size() * 64; p++) {
+        if (!(pages[p / 64] & (1ULL << (p % 64))))
+            continue;
+        size_t t = p * PAGE_SIZE / srcStride;
+        size_t b = ((p + 1) * PAGE_SIZE + srcStride - 1) / srcStride;
+        if (t < next)
+            t = next;
+        if (b > rows)
+            b = rows;
+        for (size_t y = t; y < b; y++) {
+            if (!memcmp(dst + y * dstStride, src + y * srcStride, rowBytes))
+                continue;
+            if (y != last) {
+                if (last > first) {
+                    copyRows(dst + first * dstStride, dstStride,
+                            src + first * srcStride, srcStride,
+                            rowBytes, last - first);
+                    copied += last - first;
+                }
+                first = y;
+            }
+            last = y + 1;
+            const size_t start = y * srcStride / PAGE_SIZE;
+            const size_t end = (y * srcStride + rowBytes - 1) / PAGE_SIZE;
+            for (size_t q = start; q <= end && q / 64 < changed->size(); q++)
+                (*changed)[q / 64] |= 1ULL << (q % 64);
+        }
+        if (b > next)
+            next = b;
+    }
+    if (last > first) {
+        copyRows(dst + first * dstStride, dstStride,
+                src + first * srcStride, srcStride, rowBytes, last - first);
+        copied += last - first;
+    }
+    return copied;
+}
+
+// whether a buffer is one of the screens of this display, which are flipped
+// to rather than copied. HW_FB buffers carry nothing telling the displays
+// apart, so slots are only handed out for the primary one.
+static bool fb_own_slot(const private_display_t* d, const private_handle_t* hnd)
+{
+    return (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER) &&
+            d->index == 0;
+}
+
+// whether every write to a buffer goes through this process' mapping of it,
+// the only writes damage tracking sees: buffers allocated here for the CPU
+// alone, that no GPU, device or camera renders into
+static bool fb_cpu_written(const private_handle_t* hnd)
+{
+    const private_handle_t::descriptor_t* desc = hnd->descriptor();
+    if (!desc || hnd->pid != getpid() ||
+            (hnd->flags & private_handle_t::PRIV_FLAGS_DMABUF))
+        return false;
+    const uint32_t cpuOnly = GRALLOC_USAGE_SW_READ_MASK |
+            GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_HW_TEXTURE |
+            GRALLOC_USAGE_HW_COMPOSER | GRALLOC_USAGE_HW_FB;
+    return (desc->usage & GRALLOC_USAGE_SW_WRITE_MASK) &&
+            !(desc->usage & ~cpuOnly);
+}
+
 static int fb_post(struct framebuffer_device_t* dev, buffer_handle_t buffer)
 {
     if (private_handle_t::validate(buffer) < 0)
         return -EINVAL;
 
+    fb_context_t* ctx = (fb_context_t*)dev;
     private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(buffer);
     private_module_t* m = reinterpret_cast<private_module_t*>(
             dev->common.module);
+    private_display_t* d = ctx->display;
+    GRALLOC_TRACE_SECTION("fb_post display=%u size=%d", d->index, hnd->size);
 
-    if (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER) {
-        const size_t offset = hnd->base - m->framebuffer->base;
-        m->info.activate = FB_ACTIVATE_VBL;
-        m->info.yoffset = offset / m->finfo.line_length;
-        if (ioctl(m->framebuffer->fd, FBIOPUT_VSCREENINFO, &m->info) == -1) {
+    bool hasUpdateRect = ctx->hasUpdateRect;
+    ctx->hasUpdateRect = false;
+
+    fb_wait_vsync(ctx);
+
+    if (fb_own_slot(d, hnd)) {
+        const size_t offset = hnd->offset;
+        d->info.activate = FB_ACTIVATE_VBL;
+        d->info.yoffset = offset / d->finfo.line_length;
+        if (!(d->flags & VIRTUAL) &&
+                ioctl(d->framebuffer->fd, FBIOPUT_VSCREENINFO, &d->info) == -1) {
             ALOGE("FBIOPUT_VSCREENINFO failed");
             m->base.unlock(&m->base, buffer); 
             return -errno;
         }
-        m->currentBuffer = buffer;
-        
+        d->currentBuffer = buffer;
+
+        exportFrame(ctx->exporter, (const uint8_t*)d->framebuffer->base + offset,
+                d->finfo.line_length, dev->format);
     } else {
         // If we can't do the page_flip, just copy the buffer to the front 
         // FIXME: use copybit HAL instead of memcpy
         
-        void* fb_vaddr;
-        void* buffer_vaddr;
+        void* fb_vaddr = 0;
+        void* buffer_vaddr = 0;
         
-        m->base.lock(&m->base, m->framebuffer, 
+        int err = m->base.lock(&m->base, d->framebuffer, 
                 GRALLOC_USAGE_SW_WRITE_RARELY, 
-                0, 0, m->info.xres, m->info.yres,
+                0, 0, d->info.xres, d->info.yres,
                 &fb_vaddr);
+        if (err) {
+            ALOGE("fb_post: can't lock the framebuffer (%s)", strerror(-err));
+            return err;
+        }
 
-        m->base.lock(&m->base, buffer, 
+        // lazily mapped buffers may fail to lock
+        err = m->base.lock(&m->base, buffer, 
                 GRALLOC_USAGE_SW_READ_RARELY, 
-                0, 0, m->info.xres, m->info.yres,
+                0, 0, d->info.xres, d->info.yres,
                 &buffer_vaddr);
+        if (err) {
+            ALOGE("fb_post: can't lock buffer %p (%s)", buffer, strerror(-err));
+            m->base.unlock(&m->base, d->framebuffer);
+            return err;
+        }
+
+        // handles without a descriptor are assumed to have been allocated
+        // by gralloc_alloc with the framebuffer geometry, buffers of another
+        // format are converted
+        const size_t bpp = d->info.bits_per_pixel >> 3;
+        const size_t dstStride = d->finfo.line_length;
+        const private_handle_t::descriptor_t* desc = hnd->descriptor();
+        const bool convert = desc && convertSupported(desc->format, dev->format);
+        const size_t srcBpp = convert ? formatBytesPerPixel(desc->format) : bpp;
+        const size_t srcStride = (desc ? desc->stride :
+                (d->info.xres + 1) & ~1) * srcBpp;
+        // pixels per row when converting, bytes per row when copying
+        size_t width = convert && desc->width < d->info.xres ?
+                desc->width : d->info.xres;
+        size_t rowBytes = convert ? width * bpp :
+                srcStride < dstStride ? srcStride : dstStride;
+        size_t rows = d->info.yres;
+        if (srcStride * rows > size_t(hnd->size))
+            rows = hnd->size / srcStride;
+        // exported as it is shown: from the posted buffer when it covers
+        // the screen in its layout, else from the front buffer once updated
+        const bool exportSource = !convert && rows == d->info.yres &&
+                srcStride >= d->info.xres * bpp &&
+                (!desc || formatsShareLayout(desc->format, dev->format));
+        const void* frame = exportSource ? buffer_vaddr : fb_vaddr;
+        const size_t frameStride = exportSource ? srcStride : dstStride;
+        const int frameFormat = exportSource && desc ? desc->format : dev->format;
+        size_t copied = 0;
+
+        // the copy lands in the first screen: after a flip to another one,
+        // it no longer holds the previous frame and has to be shown again
+        const bool reshow = d->info.yoffset != 0;
+        if (reshow) {
+            hasUpdateRect = false;
+            damageInvalidate(ctx->damage);
+        }
+
+        if (hasUpdateRect) {
+            // only the damaged area changed since the previous post, and the
+            // front buffer still holds the rest of it
+            size_t l = ctx->updateRect.l;
+            size_t t = ctx->updateRect.t;
+            size_t r = size_t(ctx->updateRect.r) < width ?
+                    ctx->updateRect.r : width;
+            size_t b = size_t(ctx->updateRect.b) < rows ?
+                    ctx->updateRect.b : rows;
+            if (l >= r || t >= b) {
+                rows = 0;
+            } else {
+                fb_vaddr = (uint8_t*)fb_vaddr + t * dstStride + l * bpp;
+                buffer_vaddr = (uint8_t*)buffer_vaddr + t * srcStride + l * srcBpp;
+                width = r - l;
+                rowBytes = (r - l) * bpp;
+                rows = b - t;
+            }
+            damageInvalidate(ctx->damage);
+        } else if (convert || !fb_cpu_written(hnd)) {
+            // the front buffer holds no copy of any source page, or the
+            // buffer may have been written where tracking can't see it
+            damageInvalidate(ctx->damage);
+        } else {
+            std::vector<uint64_t> pages;
+            if (damageCollect(ctx->damage, hnd->fd, buffer_vaddr, hnd->size,
+                    &pages) >= 0) {
+                std::vector<uint64_t> changed;
+                copied = rowBytes * copy_damage((uint8_t*)fb_vaddr, dstStride,
+                        (const uint8_t*)buffer_vaddr, srcStride,
+                        rowBytes, rows, pages, &changed);
+                damageCommit(ctx->damage, changed);
+                rows = 0;
+            }
+        }
+        if (rows) {
+            if (convert) {
+                convertRows(fb_vaddr, dstStride, dev->format,
+                        buffer_vaddr, srcStride, desc->format, width, rows);
+            } else {
+                copyRows(fb_vaddr, dstStride, buffer_vaddr, srcStride,
+                        rowBytes, rows);
+            }
+            copied = rowBytes * rows;
+        }
+        GRALLOC_TRACE_COUNTER("fb copy bytes", copied);
+
+        if (reshow) {
+            d->info.activate = FB_ACTIVATE_VBL;
+            d->info.yoffset = 0;
+            if (!(d->flags & VIRTUAL) &&
+                    ioctl(d->framebuffer->fd, FBIOPUT_VSCREENINFO, &d->info) == -1) {
+                err = -errno;
+                ALOGE("FBIOPUT_VSCREENINFO failed");
+            }
+        }
+
+        exportFrame(ctx->exporter, frame, frameStride, frameFormat);
 
-        memcpy(fb_vaddr, buffer_vaddr, m->finfo.line_length * m->info.yres);
-        
         m->base.unlock(&m->base, buffer); 
-        m->base.unlock(&m->base, m->framebuffer); 
+        m->base.unlock(&m->base, d->framebuffer); 
+        if (err)
+            return err;
     }
     
     return 0;
@@ -117,10 +402,115 @@ static int fb_post(struct framebuffer_device_t* dev, buffer_handle_t buffer)
 
 /*****************************************************************************/
 
-int mapFrameBufferLocked(struct private_module_t* module)
+int displayFormat(const private_display_t* display)
+{
+    return (display->info.bits_per_pixel == 32)
+           ? (display->info.red.offset ? HAL_PIXEL_FORMAT_BGRA_8888 : HAL_PIXEL_FORMAT_RGBX_8888)
+           : HAL_PIXEL_FORMAT_RGB_565;
+}
+
+static uint32_t fb_num_buffers()
+{
+    int32_t numBuffers = property_get_int32(NUM_BUFFERS_PROP, NUM_BUFFERS);
+    if (numBuffers < 1)
+        numBuffers = 1;
+    if (numBuffers > MAX_BUFFERS)
+        numBuffers = MAX_BUFFERS;
+    return numBuffers;
+}
+
+// a property of the virtual display, the primary's one unless set
+static int32_t fb_display_int32(const private_display_t* display,
+        const char* key, int32_t default_value)
+{
+    const int32_t value = property_get_int32(key, default_value);
+    if (display->index == 0)
+        return value;
+    char name[64];
+    snprintf(name, sizeof(name), "%s_%u", key, display->index);
+    return property_get_int32(name, value);
+}
+
+// Containers usually have no fbdev at all: lay out the same screens in a
+// memfd, sized from the redroid boot properties.
+static int mapVirtualFrameBufferLocked(struct private_display_t* display)
+{
+    const uint32_t numBuffers = fb_num_buffers();
+    const int32_t dpi = fb_display_int32(display, DPI_PROP, 320);
+    const int32_t xres = fb_display_int32(display, WIDTH_PROP, 720);
+    const int32_t yres = fb_display_int32(display, HEIGHT_PROP, 1280);
+
+    // the whole framebuffer must fit in smem_len
+    if (xres <= 0 || yres <= 0 || dpi <= 0 ||
+            uint64_t(xres) * yres * 4 * numBuffers > UINT32_MAX) {
+        ALOGE("invalid virtual framebuffer %dx%d, %d dpi, %u buffers",
+                xres, yres, dpi, numBuffers);
+        return -EINVAL;
+    }
+
+    struct fb_var_screeninfo info;
+    memset(&info, 0, sizeof(info));
+    info.xres = xres;
+    info.yres = yres;
+    info.xres_virtual = info.xres;
+    info.yres_virtual = info.yres * numBuffers;
+    info.bits_per_pixel = 32;
+    // RGBX_8888
+    info.red.offset = 0;
+    info.red.length = 8;
+    info.green.offset = 8;
+    info.green.length = 8;
+    info.blue.offset = 16;
+    info.blue.length = 8;
+    info.width  = ((info.xres * 25.4f)/dpi + 0.5f);
+    info.height = ((info.yres * 25.4f)/dpi + 0.5f);
+
+    struct fb_fix_screeninfo finfo;
+    memset(&finfo, 0, sizeof(finfo));
+    strncpy(finfo.id, "redroid", sizeof(finfo.id));
+    finfo.line_length = info.xres * 4;
+    finfo.smem_len = finfo.line_length * info.yres_virtual;
+
+    char value[PROPERTY_VALUE_MAX];
+    float fps = 60.0f;
+    if (property_get(FPS_PROP, value, 0) > 0 && atof(value) > 0) {
+        fps = atof(value);
+    }
+
+    size_t fbSize = roundUpToPageSize(finfo.smem_len);
+    int fd = allocRegion(fbSize);
+    if (fd < 0)
+        return fd;
+
+    void* vaddr = mmap(0, fbSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (vaddr == MAP_FAILED) {
+        int err = -errno;
+        ALOGE("Error mapping the virtual framebuffer (%s)", strerror(errno));
+        close(fd);
+        return err;
+    }
+
+    ALOGI("no fb%u, using a virtual framebuffer: %dx%d, %d dpi, %.2f Hz, "
+            "%u buffers", display->index, info.xres, info.yres, dpi, fps,
+            numBuffers);
+
+    display->flags = (numBuffers >= 2 ? PAGE_FLIP : 0) | VIRTUAL;
+    display->info = info;
+    display->finfo = finfo;
+    display->xdpi = dpi;
+    display->ydpi = dpi;
+    display->fps = fps;
+    display->numBuffers = numBuffers;
+    display->bufferMask = 0;
+    display->framebuffer = new private_handle_t(fd, fbSize, 0);
+    display->framebuffer->base = intptr_t(vaddr);
+    return 0;
+}
+
+int mapFrameBufferLocked(struct private_display_t* display)
 {
     // already initialized...
-    if (module->framebuffer) {
+    if (display->framebuffer) {
         return 0;
     }
         
@@ -134,12 +524,15 @@ int mapFrameBufferLocked(struct private_module_t* module)
     char name[64];
 
     while ((fd==-1) && device_template[i]) {
-        snprintf(name, 64, device_template[i], 0);
+        snprintf(name, 64, device_template[i], display->index);
         fd = open(name, O_RDWR, 0);
         i++;
     }
-    if (fd < 0)
-        return -errno;
+    if (fd < 0) {
+        if (display->index >= uint32_t(property_get_int32(DISPLAYS_PROP, 1)))
+            return -ENODEV;
+        return mapVirtualFrameBufferLocked(display);
+    }
 
     struct fb_fix_screeninfo finfo;
     if (ioctl(fd, FBIOGET_FSCREENINFO, &finfo) == -1)
@@ -159,7 +552,8 @@ int mapFrameBufferLocked(struct private_module_t* module)
     /*
      * Request NUM_BUFFERS screens (at lest 2 for page flipping)
      */
-    info.yres_virtual = info.yres * NUM_BUFFERS;
+    const uint32_t numBuffers = fb_num_buffers();
+    info.yres_virtual = info.yres * numBuffers;
 
 
     uint32_t flags = PAGE_FLIP;
@@ -212,6 +606,11 @@ int mapFrameBufferLocked(struct private_module_t* module)
     float ydpi = (info.yres * 25.4f) / info.height;
     float fps  = refreshRate / 1000.0f;
 
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get(FPS_PROP, value, 0) > 0 && atof(value) > 0) {
+        fps = atof(value);
+    }
+
     ALOGI(   "using (fd=%d)\n"
             "id           = %s\n"
             "xres         = %d px\n"
@@ -250,38 +649,40 @@ int mapFrameBufferLocked(struct private_module_t* module)
         return -errno;
 
 
-    module->flags = flags;
-    module->info = info;
-    module->finfo = finfo;
-    module->xdpi = xdpi;
-    module->ydpi = ydpi;
-    module->fps = fps;
+    display->flags = flags;
+    display->info = info;
+    display->finfo = finfo;
+    display->xdpi = xdpi;
+    display->ydpi = ydpi;
+    display->fps = fps;
 
     /*
      * map the framebuffer
      */
 
     size_t fbSize = roundUpToPageSize(finfo.line_length * info.yres_virtual);
-    module->framebuffer = new private_handle_t(dup(fd), fbSize, 0);
+    display->framebuffer = new private_handle_t(dup(fd), fbSize, 0);
 
-    module->numBuffers = info.yres_virtual / info.yres;
-    module->bufferMask = 0;
+    display->numBuffers = info.yres_virtual / info.yres;
+    if (display->numBuffers > numBuffers)
+        display->numBuffers = numBuffers;
+    display->bufferMask = 0;
 
     void* vaddr = mmap(0, fbSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
     if (vaddr == MAP_FAILED) {
         ALOGE("Error mapping the framebuffer (%s)", strerror(errno));
         return -errno;
     }
-    module->framebuffer->base = intptr_t(vaddr);
+    display->framebuffer->base = intptr_t(vaddr);
     memset(vaddr, 0, fbSize);
     return 0;
 }
 
-static int mapFrameBuffer(struct private_module_t* module)
+static int mapFrameBuffer(struct private_display_t* display)
 {
-    pthread_mutex_lock(&module->lock);
-    int err = mapFrameBufferLocked(module);
-    pthread_mutex_unlock(&module->lock);
+    pthread_mutex_lock(&display->lock);
+    int err = mapFrameBufferLocked(display);
+    pthread_mutex_unlock(&display->lock);
     return err;
 }
 
@@ -291,6 +692,10 @@ static int fb_close(struct hw_device_t *dev)
 {
     fb_context_t* ctx = (fb_context_t*)dev;
     if (ctx) {
+        exportClose(ctx->exporter);
+        damageClose(ctx->damage);
+        if (ctx->vsyncFd >= 0)
+            close(ctx->vsyncFd);
         free(ctx);
     }
     return 0;
@@ -299,40 +704,50 @@ static int fb_close(struct hw_device_t *dev)
 int fb_device_open(hw_module_t const* module, const char* name,
         hw_device_t** device)
 {
-    int status = -EINVAL;
-    if (!strcmp(name, GRALLOC_HARDWARE_FB0)) {
-        /* initialize our state here */
-        fb_context_t *dev = (fb_context_t*)malloc(sizeof(*dev));
-        memset(dev, 0, sizeof(*dev));
-
-        /* initialize the procs */
-        dev->device.common.tag = HARDWARE_DEVICE_TAG;
-        dev->device.common.version = 0;
-        dev->device.common.module = const_cast<hw_module_t*>(module);
-        dev->device.common.close = fb_close;
-        dev->device.setSwapInterval = fb_setSwapInterval;
-        dev->device.post            = fb_post;
-        dev->device.setUpdateRect = 0;
-
-        private_module_t* m = (private_module_t*)module;
-        status = mapFrameBuffer(m);
-        if (status >= 0) {
-            int stride = m->finfo.line_length / (m->info.bits_per_pixel >> 3);
-            int format = (m->info.bits_per_pixel == 32)
-                         ? (m->info.red.offset ? HAL_PIXEL_FORMAT_BGRA_8888 : HAL_PIXEL_FORMAT_RGBX_8888)
-                         : HAL_PIXEL_FORMAT_RGB_565;
-            const_cast<uint32_t&>(dev->device.flags) = 0;
-            const_cast<uint32_t&>(dev->device.width) = m->info.xres;
-            const_cast<uint32_t&>(dev->device.height) = m->info.yres;
-            const_cast<int&>(dev->device.stride) = stride;
-            const_cast<int&>(dev->device.format) = format;
-            const_cast<float&>(dev->device.xdpi) = m->xdpi;
-            const_cast<float&>(dev->device.ydpi) = m->ydpi;
-            const_cast<float&>(dev->device.fps) = m->fps;
-            const_cast<int&>(dev->device.minSwapInterval) = 1;
-            const_cast<int&>(dev->device.maxSwapInterval) = 1;
-            *device = &dev->device.common;
-        }
-    }
-    return status;
+    // fb0 (GRALLOC_HARDWARE_FB0) up to fb<GRALLOC_MAX_DISPLAYS - 1>
+    unsigned index;
+    char end;
+    if (sscanf(name, "fb%u%c", &index, &end) != 1 ||
+            index >= GRALLOC_MAX_DISPLAYS)
+        return -EINVAL;
+
+    private_module_t* m = (private_module_t*)module;
+    private_display_t* d = &m->displays[index];
+    int status = mapFrameBuffer(d);
+    if (status < 0)
+        return status;
+
+    /* initialize our state here */
+    fb_context_t *dev = (fb_context_t*)malloc(sizeof(*dev));
+    memset(dev, 0, sizeof(*dev));
+
+    /* initialize the procs */
+    dev->device.common.tag = HARDWARE_DEVICE_TAG;
+    dev->device.common.version = 0;
+    dev->device.common.module = const_cast<hw_module_t*>(module);
+    dev->device.common.close = fb_close;
+    dev->device.setSwapInterval = fb_setSwapInterval;
+    dev->device.post            = fb_post;
+    dev->device.setUpdateRect = fb_setUpdateRect;
+    dev->display = d;
+
+    int stride = d->finfo.line_length / (d->info.bits_per_pixel >> 3);
+    int format = displayFormat(d);
+    const_cast<uint32_t&>(dev->device.flags) = 0;
+    const_cast<uint32_t&>(dev->device.width) = d->info.xres;
+    const_cast<uint32_t&>(dev->device.height) = d->info.yres;
+    const_cast<int&>(dev->device.stride) = stride;
+    const_cast<int&>(dev->device.format) = format;
+    const_cast<float&>(dev->device.xdpi) = d->xdpi;
+    const_cast<float&>(dev->device.ydpi) = d->ydpi;
+    const_cast<float&>(dev->device.fps) = d->fps;
+    const_cast<int&>(dev->device.minSwapInterval) = 0;
+    const_cast<int&>(dev->device.maxSwapInterval) = MAX_SWAP_INTERVAL;
+    dev->damage = damageOpen();
+    dev->vsyncFd = fb_open_vsync(d->fps);
+    dev->swapInterval = 1;
+    dev->exporter = exportOpen(d->index, d->info.xres, d->info.yres,
+            d->info.bits_per_pixel >> 3, format);
+    *device = &dev->device.common;
+    return 0;
 }
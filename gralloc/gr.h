@@ -27,34 +27,192 @@
 
 #include <cutils/native_handle.h>
 
+#include <vector>
+
 /*****************************************************************************/
 
 struct private_module_t;
+struct private_display_t;
 struct private_handle_t;
 
 inline size_t roundUpToPageSize(size_t x) {
     return (x + (PAGE_SIZE-1)) & ~(PAGE_SIZE-1);
 }
 
-int mapFrameBufferLocked(struct private_module_t* module);
+// The bookkeeping done on every alloc, free, register and lock is split in
+// shards with a lock each, picked from the buffer (handle, inode or size),
+// so that threads working on different buffers don't contend.
+#define GRALLOC_SHARD_BITS 4
+#define GRALLOC_SHARDS (1 << GRALLOC_SHARD_BITS)
+
+inline size_t shardOf(uint64_t key) {
+    // Fibonacci hashing, handles and sizes have their low bits in common
+    return (key * 0x9e3779b97f4a7c15ULL) >> (64 - GRALLOC_SHARD_BITS);
+}
+
+// atrace sections and counters on the hot paths, written to trace_marker
+// only while the graphics tag is enabled, see trace.cpp. Building with
+// -DGRALLOC_TRACE=0 compiles them out.
+#ifndef GRALLOC_TRACE
+#define GRALLOC_TRACE 1
+#endif
+
+#if GRALLOC_TRACE
+#include <cutils/trace.h>
+
+inline bool traceEnabled() {
+    return atrace_is_tag_enabled(ATRACE_TAG_GRAPHICS);
+}
+
+struct trace_section_t {
+    bool active = false;
+    void begin(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+    ~trace_section_t() {
+        if (active)
+            atrace_end(ATRACE_TAG_GRAPHICS);
+    }
+};
+
+// a section lasting until the end of the enclosing scope, its name is only
+// formatted when tracing
+#define GRALLOC_TRACE_SECTION(...) \
+    trace_section_t _traceSection; \
+    if (traceEnabled()) _traceSection.begin(__VA_ARGS__)
+#define GRALLOC_TRACE_COUNTER(name, value) \
+    do { \
+        if (traceEnabled()) \
+            atrace_int64(ATRACE_TAG_GRAPHICS, name, value); \
+    } while (0)
+#else
+#define GRALLOC_TRACE_SECTION(...) do { } while (0)
+#define GRALLOC_TRACE_COUNTER(name, value) do { (void)sizeof(value); } while (0)
+#endif
+
+int mapFrameBufferLocked(struct private_display_t* display);
+// HAL pixel format of a mapped framebuffer
+int displayFormat(const struct private_display_t* display);
 int terminateBuffer(gralloc_module_t const* module, private_handle_t* hnd);
-int mapBuffer(gralloc_module_t const* module, private_handle_t* hnd);
+int mapBuffer(gralloc_module_t const* module, private_handle_t* hnd,
+        int usage);
 
-/*****************************************************************************/
+// how the CPU mapping of a buffer is set up given its usage, see mapper.cpp
+enum {
+    MAP_POLICY_DEFER      = 0x1,    // no mapping until the first lock
+    MAP_POLICY_POPULATE   = 0x2,    // prefault the pages
+    MAP_POLICY_SEQUENTIAL = 0x4,    // read ahead, read in whole
+    MAP_POLICY_DONTDUMP   = 0x8,    // keep out of core dumps
+};
+int mapPolicy(int usage, size_t size);
+int mapPolicyDump(char* buff, int buff_len);
+
+// chroma planes of a planar YUV buffer whose luma plane is 'ystride' x
+// 'vstride' pixels, see gralloc.cpp. Returns -EINVAL for other formats.
+struct yuv_planes_t {
+    size_t cstride;
+    size_t cbOffset;
+    size_t crOffset;
+    size_t chromaStep;
+    size_t size;
+};
+int yuvPlanes(int format, size_t ystride, size_t vstride, yuv_planes_t* planes);
+
+// creates a shared memory region (ashmem or memfd), see region.cpp. 'id'
+// gets the number the region is named after.
+int allocRegion(size_t size, uint32_t* id = 0);
+// same for graphic buffers, which are dma-bufs when configured so
+int allocBufferRegion(size_t size, uint32_t* id);
+// mappings of a region made after this can only read it, the ones made
+// before keep their access
+int protectRegion(int fd);
+
+// huge page backing of large buffers, see hugepage.cpp. hugePageRoundUp()
+// returns the size to allocate a buffer of 'size' with, allocHugeRegion()
+// returns -ENODEV for sizes that don't get huge pages.
+size_t hugePageRoundUp(size_t size);
+int allocHugeRegion(const char* name, size_t size);
+bool isHugeRegion(int fd, size_t size);
+void* mapHugeRegion(int fd, size_t size, bool populate);
+int hugePageDump(char* buff, int buff_len);
+
+// dma-buf backend, see dmabuf.cpp. allocDmaBuf() returns -ENODEV when
+// buffers aren't to be dma-bufs.
+int allocDmaBuf(const char* name, size_t size);
+// true when buffers are allocated as dma-bufs
+bool dmaBufEnabled();
+bool isDmaBuf(int fd);
+int syncDmaBuf(int fd, int usage, bool start);
 
-class Locker {
-    pthread_mutex_t mutex;
-public:
-    class Autolock {
-        Locker& locker;
-    public:
-        inline explicit Autolock(Locker& locker) : locker(locker) {  locker.lock(); }
-        inline ~Autolock() { locker.unlock(); }
-    };
-    inline Locker()        { pthread_mutex_init(&mutex, 0); }
-    inline ~Locker()       { pthread_mutex_destroy(&mutex); }
-    inline void lock()     { pthread_mutex_lock(&mutex); }
-    inline void unlock()   { pthread_mutex_unlock(&mutex); }
+// row-by-row copy between buffers of different strides, see copy.cpp
+void copyRows(void* dst, size_t dstStride,
+        const void* src, size_t srcStride,
+        size_t rowBytes, size_t rows);
+
+// the same, converting 'width' pixels per row between two formats, see
+// convert.cpp. Only pairs convertSupported() takes.
+void convertRows(void* dst, size_t dstStride, int dstFormat,
+        const void* src, size_t srcStride, int srcFormat,
+        size_t width, size_t rows);
+
+// pixel format conversion kernels, see convert.cpp. convertSupported() is
+// false for pairs of the same layout, which are plain copies.
+bool convertSupported(int srcFormat, int dstFormat);
+// true if both formats store their pixels the same way, like RGBA_8888 and
+// RGBX_8888
+bool formatsShareLayout(int format, int other);
+size_t formatBytesPerPixel(int format);
+void convertRow(void* dst, int dstFormat, const void* src, int srcFormat,
+        size_t width);
+// scalar kernels the SIMD ones are checked against
+void convertRowReference(void* dst, int dstFormat, const void* src,
+        int srcFormat, size_t width);
+
+// tracks which pages of the buffers posted to a front buffer may differ
+// from it, see damage.cpp. damageOpen() returns 0 when tracking is off.
+struct damage_tracker_t;
+damage_tracker_t* damageOpen();
+void damageClose(damage_tracker_t* tracker);
+// returns the number of candidate pages (one bit per page in 'pages'), or -1
+// to copy the whole buffer
+int damageCollect(damage_tracker_t* tracker, int fd,
+        const void* vaddr, size_t size, std::vector<uint64_t>* pages);
+// records the pages that changed in the front buffer after damageCollect()
+void damageCommit(damage_tracker_t* tracker,
+        const std::vector<uint64_t>& changed);
+// the front buffer was written in a way the tracker can't follow
+void damageInvalidate(damage_tracker_t* tracker);
+
+// publishes posted frames to local consumers, see export.cpp. exportOpen()
+// returns 0 when exporting is off.
+struct fb_exporter_t;
+fb_exporter_t* exportOpen(uint32_t display, uint32_t width, uint32_t height,
+        uint32_t bpp, int format);
+void exportClose(fb_exporter_t* exporter);
+// frames of another layout than the screen's, or narrower, are dropped
+void exportFrame(fb_exporter_t* exporter, const void* src, size_t srcStride,
+        int format);
+
+// live buffers of this process and latency of the gralloc calls, see
+// registry.cpp
+enum {
+    REGISTRY_ALLOC = 0,
+    REGISTRY_FREE,
+    REGISTRY_LOCK,
+    REGISTRY_OPS
 };
+void registryAdd(const private_handle_t* hnd, bool allocated);
+void registryRemove(const private_handle_t* hnd);
+// a mapping of the buffer was made (1) or dropped (-1)
+void registryMapped(const private_handle_t* hnd, int delta);
+void registryLatency(int op, int64_t start);
+int64_t registryNow();
+int registryDump(char* buff, int buff_len);
+
+// idle purgeable buffers given back to the kernel under memory pressure,
+// see purge.cpp. Every purgeLock() needs its purgeUnlock().
+void purgeTrack(const private_handle_t* hnd);
+void purgeUntrack(const private_handle_t* hnd);
+void purgeLock(const private_handle_t* hnd);
+void purgeUnlock(const private_handle_t* hnd);
+int purgeDump(char* buff, int buff_len);
 
 #endif /* GR_H_ */
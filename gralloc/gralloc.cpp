@@ -26,8 +26,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-#include <cutils/ashmem.h>
 #include <cutils/atomic.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 
 #include <hardware/gralloc.h>
@@ -38,9 +38,14 @@
 
 /*****************************************************************************/
 
+// defer mapping new buffers in the allocating process until they are
+// first locked or registered
+#define LAZY_MAP_PROP "ro.boot.redroid_gralloc_lazy_map"
+
 struct gralloc_context_t {
     alloc_device_t  device;
     /* our private data here */
+    bool lazyMap;
 };
 
 static int gralloc_alloc_buffer(alloc_device_t* dev,
@@ -62,6 +67,24 @@ extern int gralloc_lock(gralloc_module_t const* module,
 extern int gralloc_unlock(gralloc_module_t const* module, 
         buffer_handle_t handle);
 
+extern int gralloc_lock_ycbcr(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        struct android_ycbcr* ycbcr);
+
+extern int gralloc_lockAsync(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        void** vaddr, int fenceFd);
+
+extern int gralloc_unlockAsync(gralloc_module_t const* module,
+        buffer_handle_t handle, int* fenceFd);
+
+extern int gralloc_lockAsync_ycbcr(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        struct android_ycbcr* ycbcr, int fenceFd);
+
 extern int gralloc_register_buffer(gralloc_module_t const* module,
         buffer_handle_t handle);
 
@@ -74,12 +97,22 @@ static struct hw_module_methods_t gralloc_module_methods = {
         .open = gralloc_device_open
 };
 
+#define DISPLAY_INITIALIZER(i) {          \
+        .framebuffer = 0,                   \
+        .index = i,                         \
+        .flags = 0,                         \
+        .numBuffers = 0,                    \
+        .bufferMask = 0,                    \
+        .lock = PTHREAD_MUTEX_INITIALIZER,  \
+        .currentBuffer = 0,                 \
+    }
+
 struct private_module_t HAL_MODULE_INFO_SYM = {
     .base = {
         .common = {
             .tag = HARDWARE_MODULE_TAG,
-            .version_major = 1,
-            .version_minor = 0,
+            .module_api_version = GRALLOC_MODULE_API_VERSION_0_3,
+            .hal_api_version = HARDWARE_HAL_API_VERSION,
             .id = GRALLOC_HARDWARE_MODULE_ID,
             .name = "Graphics Memory Allocator Module",
             .author = "The Android Open Source Project",
@@ -89,38 +122,54 @@ struct private_module_t HAL_MODULE_INFO_SYM = {
         .unregisterBuffer = gralloc_unregister_buffer,
         .lock = gralloc_lock,
         .unlock = gralloc_unlock,
+        .lock_ycbcr = gralloc_lock_ycbcr,
+        .lockAsync = gralloc_lockAsync,
+        .unlockAsync = gralloc_unlockAsync,
+        .lockAsync_ycbcr = gralloc_lockAsync_ycbcr,
+    },
+    .displays = {
+        DISPLAY_INITIALIZER(0),
+        DISPLAY_INITIALIZER(1),
+        DISPLAY_INITIALIZER(2),
+        DISPLAY_INITIALIZER(3),
     },
-    .framebuffer = 0,
-    .flags = 0,
-    .numBuffers = 0,
-    .bufferMask = 0,
-    .lock = PTHREAD_MUTEX_INITIALIZER,
-    .currentBuffer = 0,
 };
 
 /*****************************************************************************/
 
 static int gralloc_alloc_buffer(alloc_device_t* dev,
-        size_t size, int /*usage*/, buffer_handle_t* pHandle)
+        size_t size, int usage, buffer_handle_t* pHandle)
 {
     int err = 0;
     int fd = -1;
+    uint32_t id = 0;
 
+    // dma-bufs pin their pages, they aren't padded to huge pages
     size = roundUpToPageSize(size);
-    
-    fd = ashmem_create_region("gralloc-buffer", size);
+    if (!dmaBufEnabled())
+        size = hugePageRoundUp(size);
+    GRALLOC_TRACE_SECTION("gralloc_alloc_buffer size=%zu", size);
+
+    fd = allocBufferRegion(size, &id);
     if (fd < 0) {
-        ALOGE("couldn't create ashmem (%s)", strerror(-errno));
-        err = -errno;
+        err = fd;
     }
 
     if (err == 0) {
-        private_handle_t* hnd = new private_handle_t(fd, size, 0);
+        private_handle_t* hnd = new private_handle_t(fd, size,
+                isDmaBuf(fd) ? private_handle_t::PRIV_FLAGS_DMABUF : 0);
+        hnd->desc.id = id;
         gralloc_module_t* module = reinterpret_cast<gralloc_module_t*>(
                 dev->common.module);
-        err = mapBuffer(module, hnd);
+        gralloc_context_t* ctx = reinterpret_cast<gralloc_context_t*>(dev);
+        if (!ctx->lazyMap) {
+            err = mapBuffer(module, hnd, usage);
+        }
         if (err == 0) {
             *pHandle = hnd;
+        } else {
+            close(fd);
+            delete hnd;
         }
     }
     
@@ -129,6 +178,83 @@ static int gralloc_alloc_buffer(alloc_device_t* dev,
     return err;
 }
 
+// the display framebuffer slots are handed out for: nothing in a HW_FB
+// allocation names a display, so it is the primary one, secondary
+// displays copy what is posted to them
+static private_display_t* slot_display(alloc_device_t* dev)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+    return &m->displays[0];
+}
+
+static int gralloc_alloc_framebuffer_locked(alloc_device_t* dev,
+        private_display_t* d, size_t size, int format, int usage,
+        buffer_handle_t* pHandle)
+{
+    // allocate the framebuffer
+    if (d->framebuffer == NULL) {
+        // initialize the framebuffer, the framebuffer is mapped once
+        // and forever.
+        int err = mapFrameBufferLocked(d);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    const uint32_t numBuffers = d->numBuffers;
+    const size_t bufferSize = d->finfo.line_length * d->info.yres;
+    // a slot only holds pixels laid out like the screen's, buffers of
+    // another layout are converted by fb_post
+    const int fbFormat = displayFormat(d);
+    const bool fits = formatBytesPerPixel(format) ==
+            formatBytesPerPixel(fbFormat) && !convertSupported(format, fbFormat);
+    // find a free slot, gralloc_free releases them without the lock
+    const uint32_t allBuffers = numBuffers < 32 ? (1U << numBuffers) - 1 : ~0U;
+    uint32_t bufferMask = __atomic_load_n(&d->bufferMask, __ATOMIC_ACQUIRE);
+    uint32_t index = 0;
+    bool slot = numBuffers > 1 && fits;
+    while (slot) {
+        if ((bufferMask & allBuffers) == allBuffers) {
+            // We ran out of buffers.
+            slot = false;
+            break;
+        }
+        index = __builtin_ctz(~bufferMask);
+        if (__atomic_compare_exchange_n(&d->bufferMask, &bufferMask,
+                bufferMask | (1U << index), false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+    }
+
+    if (!slot) {
+        // If we have only one buffer, or none left, we never use
+        // page-flipping. Instead, we return a regular buffer which will
+        // be memcpy'ed to the main screen when post is called.
+        int newUsage = (usage & ~GRALLOC_USAGE_HW_FB) | GRALLOC_USAGE_HW_2D;
+        return gralloc_alloc_buffer(dev, size, newUsage, pHandle);
+    }
+
+    // create a "fake" handle for it
+    private_handle_t* hnd = new private_handle_t(dup(d->framebuffer->fd),
+            bufferSize, private_handle_t::PRIV_FLAGS_FRAMEBUFFER);
+    hnd->offset = index * bufferSize;
+    hnd->base = d->framebuffer->base + hnd->offset;
+    *pHandle = hnd;
+    return 0;
+}
+
+static int gralloc_alloc_framebuffer(alloc_device_t* dev,
+        size_t size, int format, int usage, buffer_handle_t* pHandle)
+{
+    private_display_t* d = slot_display(dev);
+    pthread_mutex_lock(&d->lock);
+    int err = gralloc_alloc_framebuffer_locked(dev, d, size, format, usage,
+            pHandle);
+    pthread_mutex_unlock(&d->lock);
+    return err;
+}
+
 /*****************************************************************************/
 
 inline size_t align(size_t value, size_t alignment)
@@ -136,13 +262,102 @@ inline size_t align(size_t value, size_t alignment)
     return ((value + alignment - 1) / alignment) * alignment;
 }
 
-static int gralloc_alloc(alloc_device_t* dev,
+static void set_descriptor(private_handle_t* hnd,
+        int width, int height, int format,
+        size_t stride, size_t vstride, int usage)
+{
+    hnd->desc.width = width;
+    hnd->desc.height = height;
+    hnd->desc.format = format;
+    hnd->desc.stride = stride;
+    hnd->desc.vstride = vstride;
+    hnd->desc.usage = usage;
+    hnd->desc.version = private_handle_t::sDescriptorVersion;
+}
+
+int yuvPlanes(int format, size_t ystride, size_t vstride, yuv_planes_t* planes)
+{
+    const size_t ysize = ystride * vstride;
+    switch (format) {
+        case HAL_PIXEL_FORMAT_YV12:
+            // Y, then Cr and Cb at half resolution, as system/graphics.h
+            // specifies it
+            planes->cstride = align(ystride / 2, 16);
+            planes->crOffset = ysize;
+            planes->cbOffset = ysize + planes->cstride * (vstride / 2);
+            planes->chromaStep = 1;
+            planes->size = ysize + planes->cstride * (vstride / 2) * 2;
+            return 0;
+        case HAL_PIXEL_FORMAT_YCBCR_420_888:
+            // flexible, laid out as NV12
+            planes->cstride = ystride;
+            planes->cbOffset = ysize;
+            planes->crOffset = ysize + 1;
+            planes->chromaStep = 2;
+            planes->size = ysize + ysize / 2;
+            return 0;
+        case HAL_PIXEL_FORMAT_YCRCB_420_SP:
+            // NV21
+            planes->cstride = ystride;
+            planes->crOffset = ysize;
+            planes->cbOffset = ysize + 1;
+            planes->chromaStep = 2;
+            planes->size = ysize + ysize / 2;
+            return 0;
+    }
+    return -EINVAL;
+}
+
+static int gralloc_alloc_yuv(alloc_device_t* dev,
         int width, int height, int format, int usage,
         buffer_handle_t* pHandle, int* pStride)
 {
-    if (!pHandle || !pStride)
+    // luma alignment, encoders want whole 16x16 macroblocks
+    const bool encoder = usage & GRALLOC_USAGE_HW_VIDEO_ENCODER;
+    size_t ystride, vstride;
+    switch (format) {
+        case HAL_PIXEL_FORMAT_YV12:
+            // clients compute the plane offsets from the height themselves
+            ystride = align(width, 16);
+            vstride = height;
+            break;
+        case HAL_PIXEL_FORMAT_YCRCB_420_SP:
+            // camera clients assume the chroma follows width x height luma
+            ystride = align(width, encoder ? 16 : 2);
+            vstride = align(height, encoder ? 16 : 2);
+            break;
+        default:
+            ystride = align(width, 16);
+            vstride = align(height, encoder ? 16 : 2);
+            break;
+    }
+
+    yuv_planes_t planes;
+    if (yuvPlanes(format, ystride, vstride, &planes) < 0)
         return -EINVAL;
 
+    int err = gralloc_alloc_buffer(dev, planes.size, usage, pHandle);
+    if (err < 0)
+        return err;
+
+    set_descriptor((private_handle_t*)*pHandle, width, height, format,
+            ystride, vstride, usage);
+    *pStride = ystride;
+    return 0;
+}
+
+static int gralloc_alloc_handle(alloc_device_t* dev,
+        int width, int height, int format, int usage,
+        buffer_handle_t* pHandle, int* pStride)
+{
+    switch (format) {
+        case HAL_PIXEL_FORMAT_YV12:
+        case HAL_PIXEL_FORMAT_YCBCR_420_888:
+        case HAL_PIXEL_FORMAT_YCRCB_420_SP:
+            return gralloc_alloc_yuv(dev, width, height, format, usage,
+                    pHandle, pStride);
+    }
+
     int bytesPerPixel = 0;
     switch (format) {
         case HAL_PIXEL_FORMAT_RGBA_FP16:
@@ -158,7 +373,6 @@ static int gralloc_alloc(alloc_device_t* dev,
             break;
         case HAL_PIXEL_FORMAT_RGB_565:
         case HAL_PIXEL_FORMAT_RAW16:
-        case HAL_PIXEL_FORMAT_YV12:
             bytesPerPixel = 2;
             break;
         default:
@@ -171,29 +385,68 @@ static int gralloc_alloc(alloc_device_t* dev,
     size_t stride = align(width, tileWidth);
     size_t size = align(height, tileHeight) * stride * bytesPerPixel + 4;
 
-    int err = gralloc_alloc_buffer(dev, size, usage, pHandle);
+    int err;
+    if (usage & GRALLOC_USAGE_HW_FB) {
+        err = gralloc_alloc_framebuffer(dev, size, format, usage, pHandle);
+        const private_handle_t* hnd =
+                reinterpret_cast<const private_handle_t*>(*pHandle);
+        if (err == 0 && (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)) {
+            // a slice of the framebuffer, laid out like it
+            stride = slot_display(dev)->finfo.line_length /
+                    bytesPerPixel;
+        }
+    } else {
+        err = gralloc_alloc_buffer(dev, size, usage, pHandle);
+    }
     if (err < 0) {
         return err;
     }
 
+    set_descriptor((private_handle_t*)*pHandle, width, height, format,
+            stride, height, usage);
     *pStride = stride;
     return 0;
 }
 
+static int gralloc_alloc(alloc_device_t* dev,
+        int width, int height, int format, int usage,
+        buffer_handle_t* pHandle, int* pStride)
+{
+    if (!pHandle || !pStride)
+        return -EINVAL;
+
+    const int64_t start = registryNow();
+    GRALLOC_TRACE_SECTION("gralloc_alloc %dx%d format=%d usage=0x%x",
+            width, height, format, usage);
+    int err = gralloc_alloc_handle(dev, width, height, format, usage,
+            pHandle, pStride);
+    if (err == 0) {
+        const private_handle_t* hnd =
+                reinterpret_cast<const private_handle_t*>(*pHandle);
+        registryAdd(hnd, true);
+        purgeTrack(hnd);
+    }
+    registryLatency(REGISTRY_ALLOC, start);
+    return err;
+}
+
 static int gralloc_free(alloc_device_t* dev,
         buffer_handle_t handle)
 {
     if (private_handle_t::validate(handle) < 0)
         return -EINVAL;
 
+    const int64_t start = registryNow();
     private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(handle);
+    GRALLOC_TRACE_SECTION("gralloc_free size=%d", hnd->size);
+    registryRemove(hnd);
+    purgeUntrack(hnd);
     if (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER) {
         // free this buffer
-        private_module_t* m = reinterpret_cast<private_module_t*>(
-                dev->common.module);
-        const size_t bufferSize = m->finfo.line_length * m->info.yres;
-        int index = (hnd->base - m->framebuffer->base) / bufferSize;
-        m->bufferMask &= ~(1<<index); 
+        private_display_t* d = slot_display(dev);
+        const size_t bufferSize = d->finfo.line_length * d->info.yres;
+        int index = hnd->offset / bufferSize;
+        __atomic_fetch_and(&d->bufferMask, ~(1U << index), __ATOMIC_RELEASE);
     } else { 
         gralloc_module_t* module = reinterpret_cast<gralloc_module_t*>(
                 dev->common.module);
@@ -202,11 +455,25 @@ static int gralloc_free(alloc_device_t* dev,
 
     close(hnd->fd);
     delete hnd;
+    registryLatency(REGISTRY_FREE, start);
     return 0;
 }
 
 /*****************************************************************************/
 
+static void gralloc_dump(alloc_device_t* /*dev*/, char* buff, int buff_len)
+{
+    if (!buff || buff_len <= 0)
+        return;
+    int len = purgeDump(buff, buff_len);
+    if (len >= 0 && len < buff_len)
+        len += mapPolicyDump(buff + len, buff_len - len);
+    if (len >= 0 && len < buff_len)
+        len += hugePageDump(buff + len, buff_len - len);
+    if (len >= 0 && len < buff_len)
+        registryDump(buff + len, buff_len - len);
+}
+
 static int gralloc_close(struct hw_device_t *dev)
 {
     gralloc_context_t* ctx = reinterpret_cast<gralloc_context_t*>(dev);
@@ -238,6 +505,9 @@ int gralloc_device_open(const hw_module_t* module, const char* name,
 
         dev->device.alloc   = gralloc_alloc;
         dev->device.free    = gralloc_free;
+        dev->device.dump    = gralloc_dump;
+
+        dev->lazyMap = property_get_bool(LAZY_MAP_PROP, false);
 
         *device = &dev->device.common;
         status = 0;
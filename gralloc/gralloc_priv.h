@@ -34,17 +34,22 @@
 struct private_module_t;
 struct private_handle_t;
 
-struct private_module_t {
-    gralloc_module_t base;
+// contents their owner can redraw at any time: buffers only the CPU uses,
+// allocated with it, may be dropped under memory pressure, see purge.cpp
+#define GRALLOC_USAGE_PURGEABLE GRALLOC_USAGE_PRIVATE_2
 
+// framebuffer displays, fb0 is the primary one
+#define GRALLOC_MAX_DISPLAYS 4
+
+// one framebuffer device, each with its own lock and mapping
+struct private_display_t {
     private_handle_t* framebuffer;
+    uint32_t index;         // fb<index>
     uint32_t flags;
     uint32_t numBuffers;
     uint32_t bufferMask;
     pthread_mutex_t lock;
     buffer_handle_t currentBuffer;
-    int pmem_master;
-    void* pmem_master_base;
 
     struct fb_var_screeninfo info;
     struct fb_fix_screeninfo finfo;
@@ -53,6 +58,62 @@ struct private_module_t {
     float fps;
 };
 
+struct private_module_t {
+    gralloc_module_t base;
+
+    struct private_display_t displays[GRALLOC_MAX_DISPLAYS];
+    int pmem_master;
+    void* pmem_master_base;
+};
+
+/*****************************************************************************/
+
+/*
+ * Ring of posted frames shared with local consumers, see export.cpp.
+ *
+ * Two fds are sent over the unix socket with SCM_RIGHTS, along with their
+ * sizes as two uint64_t: the ring, which consumers can only map read-only,
+ * and a control page they map read-write. The ring header is at offset 0
+ * and slot i holds its pixels at dataOffset + i * slotSize.
+ * Frames are only published while 'waiters' is not 0: a consumer increments
+ * it while it wants frames, and decrements it when done. It reads 'latest',
+ * then the slot (latest % slots): the frame is consistent if the slot seq
+ * was even and unchanged around the read. To sleep, it FUTEX_WAITs on
+ * 'latest'. The producer never waits for consumers, slow ones just miss
+ * frames.
+ */
+
+#define FB_EXPORT_MAGIC     0x52584246
+#define FB_EXPORT_VERSION   2
+#define FB_EXPORT_MAX_SLOTS 8
+
+struct fb_export_slot_t {
+    uint32_t seq;           // odd while the slot is being written
+    uint32_t reserved;
+    uint64_t frame;         // number of the frame held by the slot
+    int64_t  timestamp;     // CLOCK_MONOTONIC of the post, in ns
+};
+
+struct fb_export_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;        // in bytes
+    int32_t  format;
+    uint32_t slots;
+    uint32_t slotSize;
+    uint32_t dataOffset;
+    uint32_t latest;        // low bits of the last frame published, futex word
+    uint32_t reserved[2];
+    struct fb_export_slot_t slot[FB_EXPORT_MAX_SLOTS];
+};
+
+struct fb_export_control_t {
+    uint32_t waiters;       // consumers wanting frames
+    uint32_t reserved;
+};
+
 /*****************************************************************************/
 
 #ifdef __cplusplus
@@ -63,7 +124,8 @@ struct private_handle_t {
 #endif
 
     enum {
-        PRIV_FLAGS_FRAMEBUFFER = 0x00000001
+        PRIV_FLAGS_FRAMEBUFFER = 0x00000001,
+        PRIV_FLAGS_DMABUF      = 0x00000002,    // fd is a dma-buf
     };
 
     // file-descriptors
@@ -78,16 +140,35 @@ struct private_handle_t {
     uint64_t base __attribute__((aligned(8)));
     int     pid;
 
+    // layout of the buffer as allocated, version 0 for buffers that don't
+    // have one (the framebuffer itself). Handles created before it was
+    // added don't carry it at all, see descriptor().
+    struct descriptor_t {
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        int32_t  format;
+        uint32_t stride;    // in pixels
+        uint32_t vstride;   // rows of the (luma) plane
+        uint32_t usage;
+        uint32_t id;        // the region is named gralloc-buffer-<id>
+    } desc;
+
 #ifdef __cplusplus
     static inline int sNumInts() {
         return (((sizeof(private_handle_t) - sizeof(native_handle_t))/sizeof(int)) - sNumFds);
     }
+    // handles without a descriptor
+    static inline int sNumIntsV0() {
+        return sNumInts() - sizeof(descriptor_t)/sizeof(int);
+    }
+    static const uint32_t sDescriptorVersion = 1;
     static const int sNumFds = 1;
     static const int sMagic = 0x3141592;
 
     private_handle_t(int fd, int size, int flags) :
         fd(fd), magic(sMagic), flags(flags), size(size), offset(0),
-        base(0), pid(getpid())
+        base(0), pid(getpid()), desc()
     {
         version = sizeof(native_handle);
         numInts = sNumInts();
@@ -100,7 +181,8 @@ struct private_handle_t {
     static int validate(const native_handle* h) {
         const private_handle_t* hnd = (const private_handle_t*)h;
         if (!h || h->version != sizeof(native_handle) ||
-                h->numInts != sNumInts() || h->numFds != sNumFds ||
+                (h->numInts != sNumInts() && h->numInts != sNumIntsV0()) ||
+                h->numFds != sNumFds ||
                 hnd->magic != sMagic)
         {
             ALOGE("invalid gralloc handle (at %p)", h);
@@ -108,6 +190,12 @@ struct private_handle_t {
         }
         return 0;
     }
+
+    const descriptor_t* descriptor() const {
+        if (numInts < sNumInts() || desc.version < 1)
+            return 0;
+        return &desc;
+    }
 #endif
 };
 
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include <linux/magic.h>
+#include <linux/memfd.h>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*****************************************************************************/
+
+// Large buffers can be backed by 2 MiB pages: a 1440p RGBA buffer is then
+// 8 TLB entries and 8 faults on first touch instead of thousands. Buffers
+// of at least the threshold are rounded up to 2 MiB and created as a memfd
+// either on shmem, mapped at 2 MiB aligned addresses with MADV_HUGEPAGE
+// (needs /sys/kernel/mm/transparent_hugepage/shmem_enabled to be advise or
+// more), or on hugetlbfs (needs a pool, vm.nr_hugepages).
+//
+// Whether the kernel actually uses huge pages is up to it, the dump reports
+// what this process got.
+
+// "thp", "hugetlb" or "off"
+#define HUGEPAGE_PROP     "ro.boot.redroid_gralloc_hugepage"
+// buffers of at least this many MiB get huge pages
+#define HUGEPAGE_MIN_PROP "ro.boot.redroid_gralloc_hugepage_min"
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+#define SHMEM_ENABLED "/sys/kernel/mm/transparent_hugepage/shmem_enabled"
+#define NR_HUGEPAGES  "/sys/kernel/mm/hugepages/hugepages-2048kB/nr_hugepages"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+enum {
+    HUGEPAGE_OFF = 0,
+    HUGEPAGE_THP,
+    HUGEPAGE_HUGETLB,
+};
+
+static const char* const sHugePageModes[] = { "off", "thp", "hugetlb" };
+
+static pthread_once_t sHugePageOnce = PTHREAD_ONCE_INIT;
+static int sHugePageMode = HUGEPAGE_OFF;
+static size_t sHugePageMin;
+
+static struct {
+    uint64_t regions;
+    uint64_t fallbacks;
+    uint64_t mapped;
+} sHugePageStats;               // atomic
+
+// reads the first line of a sysfs file, false if there is none
+static bool read_line(const char* path, char* line, size_t len)
+{
+    FILE* f = fopen(path, "re");
+    if (!f)
+        return false;
+    bool ok = fgets(line, len, f) != 0;
+    fclose(f);
+    return ok;
+}
+
+static void hugepage_init()
+{
+    char mode[PROPERTY_VALUE_MAX];
+    property_get(HUGEPAGE_PROP, mode, "off");
+    sHugePageMin = size_t(property_get_int64(HUGEPAGE_MIN_PROP, 4)) << 20;
+    if (sHugePageMin < HUGE_PAGE_SIZE)
+        sHugePageMin = HUGE_PAGE_SIZE;
+
+    char line[128];
+    if (!strcmp(mode, "hugetlb")) {
+        if (read_line(NR_HUGEPAGES, line, sizeof(line)) && atol(line) > 0) {
+            sHugePageMode = HUGEPAGE_HUGETLB;
+        } else {
+            ALOGW("no hugetlb pool configured, using transparent huge pages");
+            strcpy(mode, "thp");
+        }
+    }
+    if (!strcmp(mode, "thp")) {
+        // the active setting is the one in brackets
+        if (read_line(SHMEM_ENABLED, line, sizeof(line)) &&
+                !strstr(line, "[never]") && !strstr(line, "[deny]")) {
+            sHugePageMode = HUGEPAGE_THP;
+        } else {
+            ALOGW("transparent huge pages are off for shmem, "
+                    "buffers won't get huge pages");
+        }
+    }
+    if (sHugePageMode != HUGEPAGE_OFF) {
+        ALOGI("huge pages (%s) for buffers of %zu MiB or more",
+                sHugePageModes[sHugePageMode], sHugePageMin >> 20);
+    }
+}
+
+static int huge_page_mode()
+{
+    pthread_once(&sHugePageOnce, hugepage_init);
+    return sHugePageMode;
+}
+
+// parses the kB value of 'key' out of a smaps_rollup line
+static bool smaps_value(const char* line, const char* key, uint64_t* kb)
+{
+    const size_t len = strlen(key);
+    if (strncmp(line, key, len) || line[len] != ':')
+        return false;
+    *kb = strtoull(line + len + 1, 0, 10);
+    return true;
+}
+
+/*****************************************************************************/
+
+size_t hugePageRoundUp(size_t size)
+{
+    if (huge_page_mode() == HUGEPAGE_OFF || size < sHugePageMin)
+        return size;
+    return (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+
+int allocHugeRegion(const char* name, size_t size)
+{
+    const int mode = huge_page_mode();
+    if (mode == HUGEPAGE_OFF || size < sHugePageMin ||
+            size % HUGE_PAGE_SIZE)
+        return -ENODEV;
+
+    unsigned int flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+    if (mode == HUGEPAGE_HUGETLB)
+        flags |= MFD_HUGETLB | MFD_HUGE_2MB;
+    int fd = syscall(__NR_memfd_create, name, flags);
+    if (fd < 0 || ftruncate(fd, size) < 0 ||
+            fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+        int err = -errno;
+        ALOGW("couldn't create a %s region of %zu bytes (%s)",
+                sHugePageModes[mode], size, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        __atomic_fetch_add(&sHugePageStats.fallbacks, 1, __ATOMIC_RELAXED);
+        return err;
+    }
+    __atomic_fetch_add(&sHugePageStats.regions, 1, __ATOMIC_RELAXED);
+    return fd;
+}
+
+bool isHugeRegion(int fd, size_t size)
+{
+    if (huge_page_mode() == HUGEPAGE_OFF || size < sHugePageMin ||
+            size % HUGE_PAGE_SIZE)
+        return false;
+    // the allocator may have fallen back to a regular region
+    struct statfs st;
+    return fstatfs(fd, &st) == 0 &&
+            (st.f_type == TMPFS_MAGIC || st.f_type == HUGETLBFS_MAGIC);
+}
+
+void* mapHugeRegion(int fd, size_t size, bool populate)
+{
+    // reserve a huge page more than needed and map the region at the
+    // first aligned address in it, only then can the kernel map it with
+    // PMDs
+    void* reserved = mmap(0, size + HUGE_PAGE_SIZE, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED)
+        return reserved;
+    const uintptr_t start = uintptr_t(reserved);
+    const uintptr_t aligned = (start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    void* vaddr = mmap((void*)aligned, size, PROT_READ|PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, fd, 0);
+    if (vaddr == MAP_FAILED) {
+        int err = errno;
+        munmap(reserved, size + HUGE_PAGE_SIZE);
+        errno = err;
+        return vaddr;
+    }
+    if (aligned > start)
+        munmap(reserved, aligned - start);
+    if (start + HUGE_PAGE_SIZE > aligned)
+        munmap((void*)(aligned + size), start + HUGE_PAGE_SIZE - aligned);
+
+    // before the first fault, the pages are allocated by it. Only hints.
+    madvise(vaddr, size, MADV_HUGEPAGE);
+    if (populate)
+        madvise(vaddr, size, MADV_POPULATE_WRITE);
+    __atomic_fetch_add(&sHugePageStats.mapped, 1, __ATOMIC_RELAXED);
+    return vaddr;
+}
+
+int hugePageDump(char* buff, int buff_len)
+{
+    if (huge_page_mode() == HUGEPAGE_OFF)
+        return snprintf(buff, buff_len, "huge pages off\n");
+
+    // what the kernel gave this process, buffers or not
+    uint64_t pmdMapped = 0, hugetlb = 0, kb;
+    FILE* f = fopen("/proc/self/smaps_rollup", "re");
+    if (f) {
+        char line[128];
+        while (fgets(line, sizeof(line), f)) {
+            if (smaps_value(line, "ShmemPmdMapped", &kb))
+                pmdMapped = kb;
+            else if (smaps_value(line, "Shared_Hugetlb", &kb))
+                hugetlb = kb;
+        }
+        fclose(f);
+    }
+    return snprintf(buff, buff_len,
+            "huge pages %s, %zu MiB or more: regions=%llu fallbacks=%llu "
+            "mapped=%llu, got %llu thp and %llu hugetlb pages\n",
+            sHugePageModes[sHugePageMode], sHugePageMin >> 20,
+            (unsigned long long)__atomic_load_n(&sHugePageStats.regions, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&sHugePageStats.fallbacks, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&sHugePageStats.mapped, __ATOMIC_RELAXED),
+            (unsigned long long)(pmdMapped >> 11),
+            (unsigned long long)(hugetlb >> 11));
+}
@@ -16,38 +16,274 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
 #include <pthread.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <stdio.h>
+
+#include <map>
+#include <utility>
+
 #include <cutils/atomic.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 
 #include <hardware/hardware.h>
 #include <hardware/gralloc.h>
 
 #include "gralloc_priv.h"
+#include "gr.h"
+
+
+/*****************************************************************************/
+
+// A process maps each region only once, however many handles it holds to
+// it. Regions are identified by the inode behind their fd, which is unique
+// for memfd; ashmem fds all report the /dev/ashmem node, so those still get
+// one mapping per handle.
+
+struct mapping_t {
+    void* vaddr;
+    size_t size;
+    int refs;
+};
+
+typedef std::pair<dev_t, ino_t> mapping_key_t;
+
+// sharded by inode
+struct mapping_shard_t {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    std::map<mapping_key_t, mapping_t> mappings;
+};
+static mapping_shard_t sMappings[GRALLOC_SHARDS];
+
+// serialize the first lock of buffers allocated with lazy mapping, sharded
+// by handle
+static struct {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+} __attribute__((aligned(64))) sLazyMapLocks[GRALLOC_SHARDS];
+
+/*****************************************************************************/
+
+// The mapping of a buffer follows its usage: buffers the CPU writes often
+// are prefaulted, buffers read in whole (by the CPU or the framebuffer copy)
+// are read ahead, large textures are kept out of core dumps, and buffers
+// only the GPU touches aren't mapped until somebody locks them.
+
+// false maps every buffer the same way
+#define MAP_POLICY_PROP "ro.boot.redroid_gralloc_map_policy"
+
+// textures at least this large are left out of core dumps
+#define DONTDUMP_MIN_SIZE (1 << 20)
+
+enum {
+    MAP_STAT_MAPPED = 0,
+    MAP_STAT_DEFERRED,
+    MAP_STAT_DEFERRED_LOCKED,
+    MAP_STAT_POPULATE,
+    MAP_STAT_SEQUENTIAL,
+    MAP_STAT_DONTDUMP,
+    MAP_STATS
+};
+
+static pthread_once_t sMapPolicyOnce = PTHREAD_ONCE_INIT;
+static bool sMapPolicyEnabled;
+static uint64_t sMapStats[MAP_STATS];
+
+static void map_policy_init()
+{
+    sMapPolicyEnabled = property_get_bool(MAP_POLICY_PROP, true);
+}
+
+static void map_stat(int stat)
+{
+    __atomic_fetch_add(&sMapStats[stat], 1, __ATOMIC_RELAXED);
+}
+
+int mapPolicy(int usage, size_t size)
+{
+    pthread_once(&sMapPolicyOnce, map_policy_init);
+    if (!sMapPolicyEnabled)
+        return 0;
+
+    const int read = usage & GRALLOC_USAGE_SW_READ_MASK;
+    const int write = usage & GRALLOC_USAGE_SW_WRITE_MASK;
+    const int scanout = usage & (GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_COMPOSER);
+
+    int policy = 0;
+    if (!read && !write && !scanout)
+        policy |= MAP_POLICY_DEFER;
+    if (write == GRALLOC_USAGE_SW_WRITE_OFTEN)
+        policy |= MAP_POLICY_POPULATE;
+    if (read == GRALLOC_USAGE_SW_READ_OFTEN || scanout)
+        policy |= MAP_POLICY_SEQUENTIAL;
+    if ((usage & GRALLOC_USAGE_HW_TEXTURE) && size >= DONTDUMP_MIN_SIZE)
+        policy |= MAP_POLICY_DONTDUMP;
+    return policy;
+}
 
+int mapPolicyDump(char* buff, int buff_len)
+{
+    uint64_t stats[MAP_STATS];
+    for (int i = 0; i < MAP_STATS; i++)
+        stats[i] = __atomic_load_n(&sMapStats[i], __ATOMIC_RELAXED);
+    return snprintf(buff, buff_len,
+            "map policy %s: mapped=%llu deferred=%llu (locked later %llu) "
+            "populate=%llu sequential=%llu dontdump=%llu\n",
+            sMapPolicyEnabled ? "on" : "off",
+            (unsigned long long)stats[MAP_STAT_MAPPED],
+            (unsigned long long)stats[MAP_STAT_DEFERRED],
+            (unsigned long long)stats[MAP_STAT_DEFERRED_LOCKED],
+            (unsigned long long)stats[MAP_STAT_POPULATE],
+            (unsigned long long)stats[MAP_STAT_SEQUENTIAL],
+            (unsigned long long)stats[MAP_STAT_DONTDUMP]);
+}
+
+static void* map_new_region(int fd, size_t size, int policy)
+{
+    void* vaddr;
+    if (isHugeRegion(fd, size)) {
+        vaddr = mapHugeRegion(fd, size, policy & MAP_POLICY_POPULATE);
+    } else {
+        int flags = MAP_SHARED;
+        if (policy & MAP_POLICY_POPULATE)
+            flags |= MAP_POPULATE;
+        vaddr = mmap(0, size, PROT_READ|PROT_WRITE, flags, fd, 0);
+    }
+    if (vaddr == MAP_FAILED)
+        return vaddr;
+
+    map_stat(MAP_STAT_MAPPED);
+    if (policy & MAP_POLICY_POPULATE)
+        map_stat(MAP_STAT_POPULATE);
+    // the advice is only a hint, failing to give it isn't an error
+    if (policy & MAP_POLICY_SEQUENTIAL) {
+        madvise(vaddr, size, MADV_SEQUENTIAL);
+        madvise(vaddr, size, MADV_WILLNEED);
+        map_stat(MAP_STAT_SEQUENTIAL);
+    }
+    if (policy & MAP_POLICY_DONTDUMP) {
+        madvise(vaddr, size, MADV_DONTDUMP);
+        map_stat(MAP_STAT_DONTDUMP);
+    }
+    return vaddr;
+}
+
+// the policy of a buffer that was allocated or registered earlier
+static int handle_map_policy(const private_handle_t* hnd)
+{
+    const private_handle_t::descriptor_t* desc = hnd->descriptor();
+    return desc ? mapPolicy(desc->usage, hnd->size) : 0;
+}
 
 /*****************************************************************************/
 
+// the shard of the region behind 'fd', null for ashmem
+static mapping_shard_t* mapping_shard(int fd, mapping_key_t* key)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || S_ISCHR(st.st_mode))
+        return 0;
+    *key = mapping_key_t(st.st_dev, st.st_ino);
+    return &sMappings[shardOf(uint64_t(st.st_ino))];
+}
+
+static void* map_region(int fd, size_t size, int policy)
+{
+    mapping_key_t key;
+    mapping_shard_t* shard = mapping_shard(fd, &key);
+    if (!shard) {
+        return map_new_region(fd, size, policy);
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    auto it = shard->mappings.find(key);
+    if (it != shard->mappings.end() && it->second.size == size) {
+        it->second.refs++;
+        void* vaddr = it->second.vaddr;
+        pthread_mutex_unlock(&shard->lock);
+        return vaddr;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    // mmap (and prefaulting) can take a while, don't hold the shard
+    void* vaddr = map_new_region(fd, size, policy);
+    if (vaddr == MAP_FAILED)
+        return vaddr;
+
+    pthread_mutex_lock(&shard->lock);
+    it = shard->mappings.find(key);
+    if (it == shard->mappings.end()) {
+        shard->mappings[key] = mapping_t{ vaddr, size, 1 };
+    } else if (it->second.size == size) {
+        // another thread mapped it in the meantime, use that one
+        it->second.refs++;
+        void* existing = it->second.vaddr;
+        pthread_mutex_unlock(&shard->lock);
+        munmap(vaddr, size);
+        return existing;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return vaddr;
+}
+
+static int unmap_region(int fd, void* vaddr, size_t size)
+{
+    mapping_key_t key;
+    mapping_shard_t* shard = mapping_shard(fd, &key);
+    if (shard) {
+        pthread_mutex_lock(&shard->lock);
+        auto it = shard->mappings.find(key);
+        if (it != shard->mappings.end() && it->second.vaddr == vaddr) {
+            if (--it->second.refs > 0) {
+                pthread_mutex_unlock(&shard->lock);
+                return 0;
+            }
+            shard->mappings.erase(it);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return munmap(vaddr, size);
+}
+
 static int gralloc_map(gralloc_module_t const* /*module*/,
-        buffer_handle_t handle,
+        buffer_handle_t handle, int policy,
         void** vaddr)
 {
     private_handle_t* hnd = (private_handle_t*)handle;
-    if (!(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)) {
+    if (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER) {
+        if (hnd->pid != getpid()) {
+            // a framebuffer slot allocated by another process, its base
+            // is meaningless here: map the framebuffer up to the slot
+            size_t size = hnd->offset + hnd->size;
+            void* mappedAddress = mmap(0, size,
+                    PROT_READ|PROT_WRITE, MAP_SHARED, hnd->fd, 0);
+            if (mappedAddress == MAP_FAILED) {
+                ALOGE("Could not mmap framebuffer %s", strerror(errno));
+                return -errno;
+            }
+            hnd->base = uintptr_t(mappedAddress) + hnd->offset;
+            registryMapped(hnd, 1);
+        }
+    } else if (policy & MAP_POLICY_DEFER) {
+        // mapped by the first lock, if any
+        map_stat(MAP_STAT_DEFERRED);
+    } else {
         size_t size = hnd->size;
-        void* mappedAddress = mmap(0, size,
-                PROT_READ|PROT_WRITE, MAP_SHARED, hnd->fd, 0);
+        GRALLOC_TRACE_SECTION("gralloc_map size=%zu policy=0x%x", size, policy);
+        void* mappedAddress = map_region(hnd->fd, size, policy);
         if (mappedAddress == MAP_FAILED) {
             ALOGE("Could not mmap %s", strerror(errno));
             return -errno;
         }
         hnd->base = uintptr_t(mappedAddress) + hnd->offset;
+        registryMapped(hnd, 1);
         //ALOGD("gralloc_map() succeeded fd=%d, off=%d, size=%d, vaddr=%p",
         //        hnd->fd, hnd->offset, hnd->size, mappedAddress);
     }
@@ -59,14 +295,23 @@ static int gralloc_unmap(gralloc_module_t const* /*module*/,
         buffer_handle_t handle)
 {
     private_handle_t* hnd = (private_handle_t*)handle;
-    if (!(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)) {
-        void* base = (void*)hnd->base;
+    if (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER) {
+        if (hnd->pid != getpid()) {
+            void* base = (void*)(hnd->base - hnd->offset);
+            if (munmap(base, hnd->offset + hnd->size) < 0) {
+                ALOGE("Could not unmap framebuffer %s", strerror(errno));
+            }
+        }
+    } else {
+        void* base = (void*)(hnd->base - hnd->offset);
         size_t size = hnd->size;
         //ALOGD("unmapping from %p, size=%d", base, size);
-        if (munmap(base, size) < 0) {
+        if (unmap_region(hnd->fd, base, size) < 0) {
             ALOGE("Could not unmap %s", strerror(errno));
         }
     }
+    if (hnd->base)
+        registryMapped(hnd, -1);
     hnd->base = 0;
     return 0;
 }
@@ -79,48 +324,26 @@ int gralloc_register_buffer(gralloc_module_t const* module,
     if (private_handle_t::validate(handle) < 0)
         return -EINVAL;
 
-    // *** WARNING WARNING WARNING ***
-    //
-    // If a buffer handle is passed from the process that allocated it to a
-    // different process, and then back to the allocator process, we will
-    // create a second mapping of the buffer. If the process reads and writes
-    // through both mappings, normal memory ordering guarantees may be
-    // violated, depending on the processor cache implementation*.
-    //
-    // If you are deriving a new gralloc implementation from this code, don't
-    // do this. A "real" gralloc should provide a single reference-counted
-    // mapping for each buffer in a process.
-    //
-    // In the current system, there is one case that needs a buffer to be
-    // registered in the same process that allocated it. The SurfaceFlinger
-    // process acts as the IGraphicBufferAlloc Binder provider, so all gralloc
-    // allocations happen in its process. After returning the buffer handle to
-    // the IGraphicBufferAlloc client, SurfaceFlinger free's its handle to the
-    // buffer (unmapping it from the SurfaceFlinger process). If
-    // SurfaceFlinger later acts as the producer end of the buffer queue the
-    // buffer belongs to, it will get a new handle to the buffer in response
-    // to IGraphicBufferProducer::requestBuffer(). Like any buffer handle
-    // received through Binder, the SurfaceFlinger process will register it.
-    // Since it already freed its original handle, it will only end up with
-    // one mapping to the buffer and there will be no problem.
-    //
-    // Currently SurfaceFlinger only acts as a buffer producer for a remote
-    // consumer when taking screenshots and when using virtual displays.
+    // A buffer passed from the process that allocated it to a different
+    // process, and then back to the allocator process, used to get a second
+    // mapping here. Reading and writing through both mappings may violate
+    // normal memory ordering guarantees on virtually-indexed caches, so
+    // gralloc_map() now hands out the process' existing mapping of the
+    // region and counts references to it instead.
     //
-    // Eventually, each application should be allowed to make its own gralloc
-    // allocations, solving the problem. Also, this ashmem-based gralloc
-    // should go away, replaced with a real ion-based gralloc.
-    //
-    // * Specifically, associative virtually-indexed caches are likely to have
-    //   problems. Most modern L1 caches fit that description.
-
-    private_handle_t* hnd = (private_handle_t*)handle;
-    ALOGD_IF(hnd->pid == getpid(),
-            "Registering a buffer in the process that created it. "
-            "This may cause memory ordering problems.");
+    // ashmem regions can't be told apart from their fd, so with the ashmem
+    // backend the second mapping (and the hazard) remains. SurfaceFlinger
+    // frees its original handle right after handing it out, so in practice
+    // it still ends up with a single mapping.
 
     void *vaddr;
-    return gralloc_map(module, handle, &vaddr);
+    int err = gralloc_map(module, handle,
+            handle_map_policy((const private_handle_t*)handle), &vaddr);
+    if (err == 0) {
+        registryAdd((const private_handle_t*)handle, false);
+        purgeTrack((const private_handle_t*)handle);
+    }
+    return err;
 }
 
 int gralloc_unregister_buffer(gralloc_module_t const* module,
@@ -130,6 +353,8 @@ int gralloc_unregister_buffer(gralloc_module_t const* module,
         return -EINVAL;
 
     private_handle_t* hnd = (private_handle_t*)handle;
+    registryRemove(hnd);
+    purgeUntrack(hnd);
     if (hnd->base)
         gralloc_unmap(module, handle);
 
@@ -137,10 +362,10 @@ int gralloc_unregister_buffer(gralloc_module_t const* module,
 }
 
 int mapBuffer(gralloc_module_t const* module,
-        private_handle_t* hnd)
+        private_handle_t* hnd, int usage)
 {
     void* vaddr;
-    return gralloc_map(module, hnd, &vaddr);
+    return gralloc_map(module, hnd, mapPolicy(usage, hnd->size), &vaddr);
 }
 
 int terminateBuffer(gralloc_module_t const* module,
@@ -154,34 +379,194 @@ int terminateBuffer(gralloc_module_t const* module,
     return 0;
 }
 
-int gralloc_lock(gralloc_module_t const* /*module*/,
-        buffer_handle_t handle, int /*usage*/,
+// complain about fences that take longer than this to signal
+#define FENCE_WARN_MS 1000
+
+static int64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// waits for the acquire fence of a buffer and closes it
+static void wait_fence(int fenceFd)
+{
+    if (fenceFd < 0)
+        return;
+
+    GRALLOC_TRACE_SECTION("gralloc_wait_fence %d", fenceFd);
+    const int64_t start = now_us();
+    struct pollfd pfd;
+    pfd.fd = fenceFd;
+    pfd.events = POLLIN;
+    for (int waited = 0; ; waited += FENCE_WARN_MS) {
+        int n = poll(&pfd, 1, FENCE_WARN_MS);
+        if (n > 0) {
+            // signaled, possibly with an error: the CPU access goes on,
+            // the contents are whatever the device left
+            ALOGW_IF(pfd.revents & POLLERR, "fence %d signaled an error", fenceFd);
+            break;
+        }
+        if (n == 0) {
+            ALOGW("still waiting for fence %d after %d ms", fenceFd,
+                    waited + FENCE_WARN_MS);
+            continue;
+        }
+        if (errno != EINTR) {
+            ALOGE("couldn't wait for fence %d (%s)", fenceFd, strerror(errno));
+            break;
+        }
+    }
+    close(fenceFd);
+    GRALLOC_TRACE_COUNTER("gralloc fence wait us", now_us() - start);
+}
+
+int gralloc_lockAsync(gralloc_module_t const* /*module*/,
+        buffer_handle_t handle, int usage,
         int /*l*/, int /*t*/, int /*w*/, int /*h*/,
-        void** vaddr)
+        void** vaddr, int fenceFd)
 {
     // this is called when a buffer is being locked for software
-    // access. in thin implementation we have nothing to do since
-    // not synchronization with the h/w is needed.
-    // typically this is used to wait for the h/w to finish with
-    // this buffer if relevant. the data cache may need to be
-    // flushed or invalidated depending on the usage bits and the
-    // hardware.
+    // access. the h/w is waited for through the acquire fence, if
+    // any, and the data cache of dma-bufs is invalidated depending on
+    // the usage bits.
 
-    if (private_handle_t::validate(handle) < 0)
+    if (private_handle_t::validate(handle) < 0) {
+        if (fenceFd >= 0)
+            close(fenceFd);
         return -EINVAL;
+    }
 
+    const int64_t start = registryNow();
     private_handle_t* hnd = (private_handle_t*)handle;
-    *vaddr = (void*)hnd->base;
+    GRALLOC_TRACE_SECTION("gralloc_lock size=%d usage=0x%x", hnd->size, usage);
+    void* base = (void*)__atomic_load_n(&hnd->base, __ATOMIC_ACQUIRE);
+    if (!base) {
+        // allocated without a mapping, map it on first use
+        pthread_mutex_t* lazyMapLock =
+                &sLazyMapLocks[shardOf(uintptr_t(hnd))].lock;
+        pthread_mutex_lock(lazyMapLock);
+        int err = 0;
+        if (!hnd->base) {
+            const int policy = handle_map_policy(hnd);
+            void* mappedAddress = map_region(hnd->fd, hnd->size,
+                    policy & ~MAP_POLICY_DEFER);
+            if (mappedAddress == MAP_FAILED) {
+                ALOGE("Could not mmap %s", strerror(errno));
+                err = -errno;
+            } else {
+                if (policy & MAP_POLICY_DEFER)
+                    map_stat(MAP_STAT_DEFERRED_LOCKED);
+                __atomic_store_n(&hnd->base,
+                        uintptr_t(mappedAddress) + hnd->offset, __ATOMIC_RELEASE);
+                registryMapped(hnd, 1);
+            }
+        }
+        base = (void*)hnd->base;
+        pthread_mutex_unlock(lazyMapLock);
+        if (err) {
+            if (fenceFd >= 0)
+                close(fenceFd);
+            return err;
+        }
+    }
+    // the mapping is set up while the device may still be at work, only
+    // the access itself waits for it
+    wait_fence(fenceFd);
+    // a purged buffer reads back as zeroes until its owner redraws it
+    purgeLock(hnd);
+    if (hnd->flags & private_handle_t::PRIV_FLAGS_DMABUF) {
+        // wait for the devices and make their writes visible to the CPU
+        int err = syncDmaBuf(hnd->fd, usage, true);
+        if (err) {
+            purgeUnlock(hnd);
+            return err;
+        }
+    }
+    *vaddr = base;
+    registryLatency(REGISTRY_LOCK, start);
+    return 0;
+}
+
+int gralloc_lock(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        void** vaddr)
+{
+    return gralloc_lockAsync(module, handle, usage, l, t, w, h, vaddr, -1);
+}
+
+int gralloc_lockAsync_ycbcr(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        struct android_ycbcr* ycbcr, int fenceFd)
+{
+    const private_handle_t::descriptor_t* desc = 0;
+    yuv_planes_t planes;
+    if (private_handle_t::validate(handle) == 0 && ycbcr) {
+        desc = ((const private_handle_t*)handle)->descriptor();
+        if (desc && yuvPlanes(desc->format, desc->stride, desc->vstride,
+                &planes) < 0)
+            desc = 0;
+    }
+    if (!desc) {
+        if (fenceFd >= 0)
+            close(fenceFd);
+        return -EINVAL;
+    }
+
+    void* vaddr;
+    int err = gralloc_lockAsync(module, handle, usage, l, t, w, h, &vaddr,
+            fenceFd);
+    if (err < 0)
+        return err;
+
+    uint8_t* base = (uint8_t*)vaddr;
+    memset(ycbcr, 0, sizeof(*ycbcr));
+    ycbcr->y = base;
+    ycbcr->cb = base + planes.cbOffset;
+    ycbcr->cr = base + planes.crOffset;
+    ycbcr->ystride = desc->stride;
+    ycbcr->cstride = planes.cstride;
+    ycbcr->chroma_step = planes.chromaStep;
     return 0;
 }
 
+int gralloc_lock_ycbcr(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        struct android_ycbcr* ycbcr)
+{
+    return gralloc_lockAsync_ycbcr(module, handle, usage, l, t, w, h,
+            ycbcr, -1);
+}
+
 int gralloc_unlock(gralloc_module_t const* /*module*/,
         buffer_handle_t handle)
 {
-    // we're done with a software buffer. nothing to do in this
-    // implementation. typically this is used to flush the data cache.
+    // we're done with a software buffer. only dma-bufs have anything
+    // to do here: the data cache is flushed for the devices.
 
     if (private_handle_t::validate(handle) < 0)
         return -EINVAL;
+    const private_handle_t* hnd = (const private_handle_t*)handle;
+    purgeUnlock(hnd);
+    if (hnd->flags & private_handle_t::PRIV_FLAGS_DMABUF) {
+        // the lock usage isn't known anymore, flush both ways
+        return syncDmaBuf(hnd->fd,
+                GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK, false);
+    }
     return 0;
 }
+
+int gralloc_unlockAsync(gralloc_module_t const* module,
+        buffer_handle_t handle, int* fenceFd)
+{
+    if (!fenceFd)
+        return -EINVAL;
+
+    // the CPU is done by the time this returns, nothing left to signal
+    *fenceFd = -1;
+    return gralloc_unlock(module, handle);
+}
@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/falloc.h>
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*****************************************************************************/
+
+// When the memory of the container is under pressure (as reported by a PSI
+// trigger), the memfd buffers only this process holds that haven't been
+// locked or registered for a while have their pages punched out. The next
+// lock finds them zeroed, and the loss is logged and counted in the dump.
+//
+// Only buffers allocated with GRALLOC_USAGE_PURGEABLE and no other usage
+// than CPU reads and writes are tracked: the owner asked for it and redraws
+// them, and every use of them goes through a lock, so the time of the last
+// one tells whether they are idle. Anything the GPU, the composer or the
+// display may read without locking is never purged.
+//
+// The region is shared with every process that imported the buffer, and
+// only the holders know whether they still use it. Each one takes a read
+// lock on its own open file description of the region (an OFD lock, that
+// closing other fds of the region doesn't drop) for as long as it tracks
+// the buffer; the one purging needs the write lock, which it only gets
+// when it is the last holder. ashmem regions can't be told apart from their
+// fd (see mapper.cpp) and are never purged.
+//
+// This is off by default and meant for hosts where idle instances should
+// rather redraw than be killed.
+
+#define PURGE_PROP      "ro.boot.redroid_gralloc_purge"
+// buffers unused for this many ms may be purged
+#define PURGE_IDLE_PROP "ro.boot.redroid_gralloc_purge_idle"
+// PSI trigger, "<some|full> <stall us> <window us>"
+#define PURGE_PSI_PROP  "ro.boot.redroid_gralloc_purge_psi"
+
+#define PSI_MEMORY "/proc/pressure/memory"
+
+enum {
+    PURGE_PINNED = 0,
+    PURGE_PURGING,      // the pages are being punched out
+    PURGE_PURGED,       // the pages are gone
+};
+
+typedef std::pair<dev_t, ino_t> region_key_t;
+
+// a region tracked through one or more handles
+struct purge_region_t {
+    int lockFd;         // own open file description, holds the read lock
+    int handles;
+    int state;
+};
+
+struct purge_entry_t {
+    region_key_t key;
+    size_t size;
+    uint32_t id;
+    int locks;
+    bool lost;          // purged since the handle was last locked
+    int64_t lastUse;
+};
+
+static pthread_once_t sPurgeOnce = PTHREAD_ONCE_INIT;
+static bool sPurgeEnabled;
+static int64_t sPurgeIdle;
+static pthread_mutex_t sPurgeLock = PTHREAD_MUTEX_INITIALIZER;
+// signaled when a region is done being purged
+static pthread_cond_t sPurgeDone = PTHREAD_COND_INITIALIZER;
+static std::map<const private_handle_t*, purge_entry_t> sPurgeable;
+static std::map<region_key_t, purge_region_t> sRegions;
+
+static struct {
+    uint64_t events;
+    uint64_t purged;
+    uint64_t purgedBytes;
+    uint64_t shared;
+    uint64_t lost;
+} sPurgeStats;
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+// read or write lock on the first byte of the region, F_UNLCK to release
+static int region_lock(int fd, short type, bool wait)
+{
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 1;
+    int ret;
+    do {
+        ret = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+// gives the idle regions only this process holds back
+static void purge_idle()
+{
+    std::vector<std::pair<region_key_t, size_t> > victims;
+
+    pthread_mutex_lock(&sPurgeLock);
+    const int64_t deadline = now_ms() - sPurgeIdle;
+    std::map<region_key_t, size_t> idle;
+    for (auto it = sPurgeable.begin(); it != sPurgeable.end(); ++it) {
+        const purge_entry_t& e = it->second;
+        if (e.locks || e.lastUse > deadline)
+            idle[e.key] = 0;    // in use through one of its handles
+        else if (!idle.count(e.key))
+            idle[e.key] = e.size;
+    }
+    for (auto it = idle.begin(); it != idle.end(); ++it) {
+        purge_region_t& r = sRegions[it->first];
+        if (!it->second || r.state != PURGE_PINNED)
+            continue;
+        // another process holding it keeps its read lock
+        if (region_lock(r.lockFd, F_WRLCK, false) < 0) {
+            sPurgeStats.shared++;
+            continue;
+        }
+        r.state = PURGE_PURGING;
+        victims.push_back(std::make_pair(it->first, it->second));
+    }
+    pthread_mutex_unlock(&sPurgeLock);
+
+    // punching can take a while, locks of these regions wait for it
+    size_t bytes = 0, count = 0;
+    for (size_t i = 0; i < victims.size(); i++) {
+        pthread_mutex_lock(&sPurgeLock);
+        const int fd = sRegions[victims[i].first].lockFd;
+        pthread_mutex_unlock(&sPurgeLock);
+
+        const bool punched = fallocate(fd,
+                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                0, victims[i].second) == 0;
+        region_lock(fd, F_RDLCK, true);
+
+        pthread_mutex_lock(&sPurgeLock);
+        sRegions[victims[i].first].state = punched ? PURGE_PURGED : PURGE_PINNED;
+        if (punched) {
+            for (auto it = sPurgeable.begin(); it != sPurgeable.end(); ++it) {
+                if (it->second.key == victims[i].first)
+                    it->second.lost = true;
+            }
+            bytes += victims[i].second;
+            count++;
+        }
+        pthread_mutex_unlock(&sPurgeLock);
+    }
+
+    pthread_mutex_lock(&sPurgeLock);
+    sPurgeStats.purged += count;
+    sPurgeStats.purgedBytes += bytes;
+    pthread_cond_broadcast(&sPurgeDone);
+    pthread_mutex_unlock(&sPurgeLock);
+    if (count) {
+        ALOGI("memory pressure: %zu idle buffers (%zu KiB) purged",
+                count, bytes >> 10);
+    }
+}
+
+static void* purge_thread(void* arg)
+{
+    struct pollfd pfd;
+    pfd.fd = int(intptr_t(arg));
+    pfd.events = POLLPRI;
+    for (;;) {
+        int n = poll(&pfd, 1, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || (pfd.revents & POLLERR)) {
+            ALOGE("PSI monitor stopped (%s)", n < 0 ? strerror(errno) : "POLLERR");
+            break;
+        }
+        if (pfd.revents & POLLPRI) {
+            pthread_mutex_lock(&sPurgeLock);
+            sPurgeStats.events++;
+            pthread_mutex_unlock(&sPurgeLock);
+            purge_idle();
+        }
+    }
+    close(pfd.fd);
+    return 0;
+}
+
+static void purge_init()
+{
+    if (!property_get_bool(PURGE_PROP, false))
+        return;
+    sPurgeIdle = property_get_int64(PURGE_IDLE_PROP, 5000);
+
+    char trigger[PROPERTY_VALUE_MAX];
+    property_get(PURGE_PSI_PROP, trigger, "some 150000 2000000");
+    int fd = open(PSI_MEMORY, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0 || write(fd, trigger, strlen(trigger) + 1) < 0) {
+        ALOGW("couldn't set up a PSI trigger \"%s\" (%s), purging disabled",
+                trigger, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, purge_thread, (void*)intptr_t(fd));
+    pthread_attr_destroy(&attr);
+    if (err) {
+        close(fd);
+        return;
+    }
+    pthread_setname_np(thread, "gralloc-purge");
+    sPurgeEnabled = true;
+    ALOGI("purging buffers idle for %lld ms on \"%s\"",
+            (long long)sPurgeIdle, trigger);
+}
+
+static bool purge_enabled()
+{
+    pthread_once(&sPurgeOnce, purge_init);
+    return sPurgeEnabled;
+}
+
+/*****************************************************************************/
+
+void purgeTrack(const private_handle_t* hnd)
+{
+    // dma-bufs can't be punched
+    const private_handle_t::descriptor_t* desc = hnd->descriptor();
+    const uint32_t cpuOnly = GRALLOC_USAGE_SW_READ_MASK |
+            GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_PURGEABLE;
+    if (!desc || !(desc->usage & GRALLOC_USAGE_PURGEABLE) ||
+            (desc->usage & ~cpuOnly) || (hnd->flags &
+            (private_handle_t::PRIV_FLAGS_FRAMEBUFFER |
+             private_handle_t::PRIV_FLAGS_DMABUF)) ||
+            !purge_enabled())
+        return;
+
+    struct stat st;
+    if (fstat(hnd->fd, &st) < 0 || S_ISCHR(st.st_mode))
+        return;
+    const region_key_t key(st.st_dev, st.st_ino);
+
+    pthread_mutex_lock(&sPurgeLock);
+    auto region = sRegions.find(key);
+    if (region == sRegions.end()) {
+        pthread_mutex_unlock(&sPurgeLock);
+        // a description of our own, the fds of handles share theirs with
+        // the other processes
+        char path[32];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", hnd->fd);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+            return;
+        // waits for a purge by the last holder to be over
+        if (region_lock(fd, F_RDLCK, true) < 0) {
+            close(fd);
+            return;
+        }
+        pthread_mutex_lock(&sPurgeLock);
+        region = sRegions.find(key);
+        if (region == sRegions.end()) {
+            region = sRegions.insert(std::make_pair(key,
+                    purge_region_t{ fd, 0, PURGE_PINNED })).first;
+        } else {
+            // tracked by another thread in the meantime
+            close(fd);
+        }
+    }
+    region->second.handles++;
+
+    purge_entry_t e;
+    e.key = key;
+    e.size = hnd->size;
+    e.id = desc->id;
+    e.locks = 0;
+    e.lost = region->second.state == PURGE_PURGED;
+    e.lastUse = now_ms();
+    sPurgeable[hnd] = e;
+    pthread_mutex_unlock(&sPurgeLock);
+}
+
+void purgeUntrack(const private_handle_t* hnd)
+{
+    if (!purge_enabled())
+        return;
+
+    int fd = -1;
+    pthread_mutex_lock(&sPurgeLock);
+    auto it = sPurgeable.find(hnd);
+    if (it != sPurgeable.end()) {
+        auto region = sRegions.find(it->second.key);
+        // a purge in progress still uses the description
+        while (region->second.state == PURGE_PURGING)
+            pthread_cond_wait(&sPurgeDone, &sPurgeLock);
+        if (--region->second.handles == 0) {
+            fd = region->second.lockFd;
+            sRegions.erase(region);
+        }
+        sPurgeable.erase(it);
+    }
+    pthread_mutex_unlock(&sPurgeLock);
+    // releases the read lock
+    if (fd >= 0)
+        close(fd);
+}
+
+void purgeLock(const private_handle_t* hnd)
+{
+    if (!purge_enabled())
+        return;
+
+    bool lost = false;
+    uint32_t id = 0;
+    pthread_mutex_lock(&sPurgeLock);
+    auto it = sPurgeable.find(hnd);
+    if (it != sPurgeable.end()) {
+        purge_entry_t& e = it->second;
+        id = e.id;
+        purge_region_t& r = sRegions[e.key];
+        while (r.state == PURGE_PURGING)
+            pthread_cond_wait(&sPurgeDone, &sPurgeLock);
+        r.state = PURGE_PINNED;
+        lost = e.lost;
+        e.lost = false;
+        e.locks++;
+        e.lastUse = now_ms();
+        if (lost)
+            sPurgeStats.lost++;
+    }
+    pthread_mutex_unlock(&sPurgeLock);
+    ALOGW_IF(lost, "contents of buffer %u were purged under memory pressure",
+            id);
+}
+
+void purgeUnlock(const private_handle_t* hnd)
+{
+    if (!purge_enabled())
+        return;
+
+    pthread_mutex_lock(&sPurgeLock);
+    auto it = sPurgeable.find(hnd);
+    if (it != sPurgeable.end()) {
+        if (it->second.locks > 0)
+            it->second.locks--;
+        it->second.lastUse = now_ms();
+    }
+    pthread_mutex_unlock(&sPurgeLock);
+}
+
+int purgeDump(char* buff, int buff_len)
+{
+    if (!purge_enabled())
+        return 0;
+
+    pthread_mutex_lock(&sPurgeLock);
+    size_t purged = 0;
+    for (auto it = sPurgeable.begin(); it != sPurgeable.end(); ++it) {
+        if (sRegions[it->second.key].state != PURGE_PINNED)
+            purged += it->second.size;
+    }
+    int len = snprintf(buff, buff_len,
+            "purge: %zu KiB purged, pressure events=%llu purged=%llu "
+            "(%llu KiB) shared=%llu lost=%llu\n",
+            purged >> 10,
+            (unsigned long long)sPurgeStats.events,
+            (unsigned long long)sPurgeStats.purged,
+            (unsigned long long)(sPurgeStats.purgedBytes >> 10),
+            (unsigned long long)sPurgeStats.shared,
+            (unsigned long long)sPurgeStats.lost);
+    pthread_mutex_unlock(&sPurgeLock);
+    return len;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/memfd.h>
+
+#include <atomic>
+
+#include <cutils/ashmem.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*****************************************************************************/
+
+// Same switch as libcutils, set from ro.boot.use_memfd or when /dev/ashmem
+// is missing (see redroid.common.rc and post-fs-data.redroid.sh).
+#define USE_MEMFD_PROP "sys.use_memfd"
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+enum {
+    REGION_ASHMEM = 0,
+    REGION_MEMFD,
+};
+
+static pthread_once_t sRegionOnce = PTHREAD_ONCE_INIT;
+static std::atomic<int> sRegionBackend(REGION_ASHMEM);
+
+static void region_init()
+{
+    if (property_get_bool(USE_MEMFD_PROP, false) ||
+            access("/dev/ashmem", F_OK) != 0) {
+        sRegionBackend = REGION_MEMFD;
+    }
+    ALOGI("allocating buffers from %s",
+            sRegionBackend == REGION_MEMFD ? "memfd" : "ashmem");
+}
+
+// regions are named after a per-process id so smaps entries can be matched
+// with the registry dumps
+static std::atomic<uint32_t> sRegionId(0);
+
+static int alloc_ashmem(const char* name, size_t size)
+{
+    int fd = ashmem_create_region(name, size);
+    if (fd < 0) {
+        ALOGE("couldn't create ashmem (%s)", strerror(errno));
+        return -errno;
+    }
+    return fd;
+}
+
+static int alloc_memfd(const char* name, size_t size)
+{
+    // memfd_create() isn't in every bionic we build against
+    int fd = syscall(__NR_memfd_create, name,
+            MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        ALOGE("couldn't create memfd (%s)", strerror(errno));
+        return -errno;
+    }
+
+    // the size is fixed once allocated: importers map hnd->size and must
+    // not see the file shrink under them
+    if (ftruncate(fd, size) < 0 ||
+            fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+        int err = -errno;
+        ALOGE("couldn't size memfd (%s)", strerror(errno));
+        close(fd);
+        return err;
+    }
+    return fd;
+}
+
+static void region_name(char* name, size_t len, uint32_t* id)
+{
+    const uint32_t n = ++sRegionId;
+    snprintf(name, len, "gralloc-buffer-%u", n);
+    if (id)
+        *id = n;
+}
+
+static int alloc_region(const char* name, size_t size)
+{
+    pthread_once(&sRegionOnce, region_init);
+
+    if (sRegionBackend == REGION_MEMFD) {
+        int fd = alloc_memfd(name, size);
+        if (fd != -ENOSYS && fd != -EINVAL)
+            return fd;
+        // kernel without memfd (or without sealing), stick to ashmem
+        ALOGW("memfd not supported, falling back to ashmem");
+        sRegionBackend = REGION_ASHMEM;
+    }
+    return alloc_ashmem(name, size);
+}
+
+int allocRegion(size_t size, uint32_t* id)
+{
+    char name[32];
+    region_name(name, sizeof(name), id);
+    return alloc_region(name, size);
+}
+
+int allocBufferRegion(size_t size, uint32_t* id)
+{
+    char name[32];
+    region_name(name, sizeof(name), id);
+    int fd = allocDmaBuf(name, size);
+    if (fd >= 0)
+        return fd;
+    fd = allocHugeRegion(name, size);
+    if (fd >= 0)
+        return fd;
+    return alloc_region(name, size);
+}
+
+int protectRegion(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return -errno;
+    // ashmem masks the protection of later mmaps, memfd seals them
+    int err = S_ISCHR(st.st_mode) ? ashmem_set_prot_region(fd, PROT_READ) :
+            fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+    return err < 0 ? -errno : 0;
+}
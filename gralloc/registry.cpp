@@ -0,0 +1,356 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <set>
+#include <string>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*****************************************************************************/
+
+// Every process keeps track of the buffers it allocated or imported, so
+// the one holding on to graphics memory can be found. The registry is
+// printed by gralloc_dump() and, when a directory is configured, served
+// on a unix socket named gralloc.<pid> in it:
+//
+//   socat - UNIX-CONNECT:/ipc/gralloc.1234
+//
+// It costs a lookup on every alloc, register and lock, so it is off unless
+// enabled for debugging.
+
+// true enables the registry and the latency histograms
+#define REGISTRY_PROP     "ro.boot.redroid_gralloc_registry"
+// directory of the dump sockets, none by default. The sockets are open to
+// the owner and group of the process only.
+#define REGISTRY_DIR_PROP "ro.boot.redroid_gralloc_registry_dir"
+
+// latency buckets, bucket i counts calls that took less than 2^i us
+#define LATENCY_BUCKETS 20
+
+struct registry_entry_t {
+    bool allocated;
+    int64_t created;
+    uint32_t maps;      // mappings of the handle in this process
+};
+
+struct registry_shard_t {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    std::map<const private_handle_t*, registry_entry_t> entries;
+};
+
+static pthread_once_t sRegistryOnce = PTHREAD_ONCE_INIT;
+static bool sRegistryEnabled;
+static char sRegistryPath[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static registry_shard_t sRegistry[GRALLOC_SHARDS];
+
+// counted per thread shard, every thread bumping the same lines would
+// serialize the calls being measured
+struct latency_shard_t {
+    uint64_t counts[REGISTRY_OPS][LATENCY_BUCKETS];
+} __attribute__((aligned(64)));
+static latency_shard_t sLatency[GRALLOC_SHARDS];
+static const char* const sOpNames[REGISTRY_OPS] = { "alloc", "free", "lock" };
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static std::string registry_dump();
+
+static void* registry_thread(void* arg)
+{
+    const int listenFd = int(intptr_t(arg));
+    for (;;) {
+        int sock = accept4(listenFd, 0, 0, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            ALOGE("registry socket failed (%s)", strerror(errno));
+            break;
+        }
+        std::string dump = registry_dump();
+        size_t done = 0;
+        while (done < dump.size()) {
+            ssize_t len = send(sock, dump.data() + done, dump.size() - done,
+                    MSG_NOSIGNAL);
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len <= 0)
+                break;
+            done += len;
+        }
+        close(sock);
+    }
+    close(listenFd);
+    return 0;
+}
+
+static void registry_unlink()
+{
+    unlink(sRegistryPath);
+}
+
+// removes the sockets of processes that died without unlinking theirs
+static void registry_sweep(const char* dir)
+{
+    DIR* d = opendir(dir);
+    if (!d)
+        return;
+    char path[PATH_MAX];
+    while (struct dirent* e = readdir(d)) {
+        char* end;
+        if (strncmp(e->d_name, "gralloc.", 8))
+            continue;
+        const long pid = strtol(e->d_name + 8, &end, 10);
+        if (*end || pid <= 0 || (kill(pid, 0) < 0 && errno == ESRCH)) {
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+}
+
+static void registry_listen(const char* dir)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/gralloc.%d",
+            dir, getpid());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return;
+    // a previous process may have had the same pid
+    registry_sweep(dir);
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            chmod(addr.sun_path, 0660) < 0 || listen(fd, 4) < 0) {
+        ALOGW("couldn't serve the registry on %s (%s)",
+                addr.sun_path, strerror(errno));
+        close(fd);
+        unlink(addr.sun_path);
+        return;
+    }
+    memcpy(sRegistryPath, addr.sun_path, sizeof(sRegistryPath));
+    atexit(registry_unlink);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, registry_thread, (void*)intptr_t(fd))) {
+        close(fd);
+    } else {
+        pthread_setname_np(thread, "gralloc-registry");
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static registry_shard_t& registry_shard(const private_handle_t* hnd)
+{
+    return sRegistry[shardOf(uintptr_t(hnd))];
+}
+
+static void registry_init()
+{
+    sRegistryEnabled = property_get_bool(REGISTRY_PROP, false);
+    if (!sRegistryEnabled)
+        return;
+
+    char dir[PROPERTY_VALUE_MAX];
+    if (property_get(REGISTRY_DIR_PROP, dir, "") > 0)
+        registry_listen(dir);
+}
+
+static bool registry_enabled()
+{
+    pthread_once(&sRegistryOnce, registry_init);
+    return sRegistryEnabled;
+}
+
+static void registry_dump_entry(const private_handle_t* hnd,
+        const registry_entry_t& entry, int64_t now, std::string* dump)
+{
+    char line[256];
+    const private_handle_t::descriptor_t* desc = hnd->descriptor();
+    const private_handle_t::descriptor_t none = {};
+    if (!desc)
+        desc = &none;
+    char maps[24] = "";
+    if (entry.maps == 1)
+        snprintf(maps, sizeof(maps), " mapped");
+    else if (entry.maps > 1)
+        snprintf(maps, sizeof(maps), " mapped x%u", entry.maps);
+    snprintf(line, sizeof(line),
+            "  %8u %7d %6u %6u %8x %8x %6d %7llds  %s%s%s\n",
+            desc->id, hnd->size >> 10, desc->width, desc->height,
+            desc->format, desc->usage, hnd->pid,
+            (long long)((now - entry.created) / 1000000000),
+            entry.allocated ? "alloc" : "import",
+            hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER ?
+                    " fb" : "",
+            maps);
+    *dump += line;
+}
+
+static std::string registry_dump()
+{
+    std::string dump;
+    char line[256];
+    const int64_t now = now_ns();
+
+    // each shard is listed as it is, the totals are summed on the way.
+    // Handles of the same region share its mapping, counted once.
+    std::string list;
+    std::set<uintptr_t> mappings;
+    size_t count = 0, allocated = 0, imported = 0, mapped = 0;
+    for (int i = 0; i < GRALLOC_SHARDS; i++) {
+        registry_shard_t& shard = sRegistry[i];
+        pthread_mutex_lock(&shard.lock);
+        count += shard.entries.size();
+        for (auto it = shard.entries.begin(); it != shard.entries.end(); ++it) {
+            const size_t size = it->first->size;
+            (it->second.allocated ? allocated : imported) += size;
+            if (it->second.maps &&
+                    mappings.insert(it->first->base - it->first->offset).second)
+                mapped += size;
+            registry_dump_entry(it->first, it->second, now, &list);
+        }
+        pthread_mutex_unlock(&shard.lock);
+    }
+    snprintf(line, sizeof(line),
+            "gralloc registry, pid %d: %zu buffers, allocated %zu KiB, "
+            "imported %zu KiB, mapped %zu KiB\n",
+            getpid(), count, allocated >> 10, imported >> 10,
+            mapped >> 10);
+    dump += line;
+    if (count) {
+        dump += "        id     KiB  width height   format    usage  owner"
+                "      age  origin\n";
+        dump += list;
+    }
+
+
+    for (int op = 0; op < REGISTRY_OPS; op++) {
+        snprintf(line, sizeof(line), "%s latency, count per us bucket:", sOpNames[op]);
+        dump += line;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            uint64_t count = 0;
+            for (int shard = 0; shard < GRALLOC_SHARDS; shard++) {
+                count += __atomic_load_n(&sLatency[shard].counts[op][i],
+                        __ATOMIC_RELAXED);
+            }
+            if (!count)
+                continue;
+            snprintf(line, sizeof(line), " <%u:%llu", 1u << i,
+                    (unsigned long long)count);
+            dump += line;
+        }
+        dump += "\n";
+    }
+    return dump;
+}
+
+/*****************************************************************************/
+
+void registryAdd(const private_handle_t* hnd, bool allocated)
+{
+    if (!registry_enabled())
+        return;
+
+    registry_shard_t& shard = registry_shard(hnd);
+    pthread_mutex_lock(&shard.lock);
+    shard.entries[hnd] = registry_entry_t{ allocated, now_ns(),
+            hnd->base ? 1u : 0u };
+    pthread_mutex_unlock(&shard.lock);
+}
+
+void registryRemove(const private_handle_t* hnd)
+{
+    if (!registry_enabled())
+        return;
+
+    registry_shard_t& shard = registry_shard(hnd);
+    pthread_mutex_lock(&shard.lock);
+    shard.entries.erase(hnd);
+    pthread_mutex_unlock(&shard.lock);
+}
+
+void registryMapped(const private_handle_t* hnd, int delta)
+{
+    if (!registry_enabled())
+        return;
+
+    registry_shard_t& shard = registry_shard(hnd);
+    pthread_mutex_lock(&shard.lock);
+    auto it = shard.entries.find(hnd);
+    if (it != shard.entries.end()) {
+        if (delta > 0)
+            it->second.maps++;
+        else if (it->second.maps > 0)
+            it->second.maps--;
+    }
+    pthread_mutex_unlock(&shard.lock);
+}
+
+int64_t registryNow()
+{
+    return registry_enabled() ? now_ns() : 0;
+}
+
+void registryLatency(int op, int64_t start)
+{
+    if (!start)
+        return;
+
+    const int64_t us = (now_ns() - start) / 1000;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && us >= (int64_t(1) << bucket))
+        bucket++;
+    latency_shard_t& shard = sLatency[shardOf(uint64_t(pthread_self()))];
+    __atomic_fetch_add(&shard.counts[op][bucket], 1, __ATOMIC_RELAXED);
+}
+
+int registryDump(char* buff, int buff_len)
+{
+    if (!registry_enabled())
+        return 0;
+
+    std::string dump = registry_dump();
+    return snprintf(buff, buff_len, "%s", dump.c_str());
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "gr.h"
+
+/*****************************************************************************/
+
+// The sections show up in systrace and Perfetto captures with the graphics
+// category, nested under the binder or SurfaceFlinger sections calling
+// into the HAL. Their names carry the sizes and formats, so they are only
+// formatted once the tag is known to be enabled.
+
+#if GRALLOC_TRACE
+
+// longer names are truncated, as atrace does
+#define TRACE_NAME_MAX 128
+
+void trace_section_t::begin(const char* fmt, ...)
+{
+    char name[TRACE_NAME_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(name, sizeof(name), fmt, ap);
+    va_end(ap);
+    atrace_begin(ATRACE_TAG_GRAPHICS, name);
+    active = true;
+}
+
+#endif